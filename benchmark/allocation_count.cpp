@@ -0,0 +1,85 @@
+#include "allocation_count.hpp"
+
+#include <malloc.h>
+#include <errno.h>
+
+#include <atomic>
+#include <cstddef>
+
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t count, size_t size);
+extern "C" void *__libc_realloc(void *pointer, size_t size);
+extern "C" void *__libc_memalign(size_t alignment, size_t size);
+extern "C" void __libc_free(void *pointer);
+
+static std::atomic<long> allocations(0);
+static std::atomic<long> bytes(0);
+
+// Counts a block given out by the allocator (if there is one), returning it.
+static void *allocated(void *pointer)
+{
+    if (pointer)
+    {
+        allocations.fetch_add(1, std::memory_order_relaxed);
+        bytes.fetch_add(malloc_usable_size(pointer), std::memory_order_relaxed);
+    }
+    return pointer;
+}
+
+extern "C" void *malloc(size_t size)
+{
+    return allocated(__libc_malloc(size));
+}
+
+extern "C" void *calloc(size_t count, size_t size)
+{
+    return allocated(__libc_calloc(count, size));
+}
+
+extern "C" void *realloc(void *pointer, size_t size)
+{
+    // The old block is given back, unless the allocation fails:
+    long old_size = pointer ? malloc_usable_size(pointer) : 0;
+    void *moved = __libc_realloc(pointer, size);
+    if (moved || size == 0)
+        bytes.fetch_sub(old_size, std::memory_order_relaxed);
+    return allocated(moved);
+}
+
+extern "C" void *memalign(size_t alignment, size_t size)
+{
+    return allocated(__libc_memalign(alignment, size));
+}
+
+extern "C" void *aligned_alloc(size_t alignment, size_t size)
+{
+    return memalign(alignment, size);
+}
+
+extern "C" int posix_memalign(void **pointer, size_t alignment, size_t size)
+{
+    if (alignment % sizeof(void *) != 0 || (alignment & (alignment - 1)) != 0)
+        return EINVAL;
+    void *block = memalign(alignment, size);
+    if (!block)
+        return ENOMEM;
+    *pointer = block;
+    return 0;
+}
+
+extern "C" void free(void *pointer)
+{
+    if (pointer)
+        bytes.fetch_sub(malloc_usable_size(pointer), std::memory_order_relaxed);
+    __libc_free(pointer);
+}
+
+long allocation_count()
+{
+    return allocations.load(std::memory_order_relaxed);
+}
+
+long allocated_bytes()
+{
+    return bytes.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,16 @@
+#ifndef ALLOCATION_COUNT_HPP
+#define ALLOCATION_COUNT_HPP
+
+/**
+ * Returns the number of heap allocations the process has made so far. They're counted by wrapping glibc's
+ * allocator (Qt's containers allocate with malloc rather than new), which is only done in the benchmark.
+ */
+long allocation_count();
+
+/**
+ * Returns the number of bytes currently allocated on the heap, as the usable sizes of the blocks given out by the
+ * same wrapped allocator (so including the rounding up of each block, but not the allocator's own bookkeeping).
+ */
+long allocated_bytes();
+
+#endif /* ALLOCATION_COUNT_HPP */
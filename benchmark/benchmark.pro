@@ -0,0 +1,14 @@
+# Headless benchmark of the bus (run on the simulated bus) and the canvas (drawn off screen), so that it doesn't
+# need a Raspberry Pi or a display.
+TARGET = benchmark
+CONFIG += console
+CONFIG -= app_bundle
+
+DESTDIR = build
+OBJECTS_DIR = build/.obj
+MOC_DIR = build/.moc
+
+include(../canvas.pri)
+
+HEADERS += bus_benchmark.hpp canvas_benchmark.h allocation_count.hpp
+SOURCES += main.cpp bus_benchmark.cpp canvas_benchmark.cpp allocation_count.cpp
@@ -0,0 +1,614 @@
+#include "bus_benchmark.hpp"
+#include "allocation_count.hpp"
+#include "serial.hpp"
+#include "simulated_bus.hpp"
+#include "packet_ring.hpp"
+
+#include <unistd.h>
+#include <time.h>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <chrono>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <cmath>
+
+// Lines used on the simulated bus.
+static const int pin_scl = 0;
+static const int pin_sda = 1;
+
+// Bitrate the workloads run at, which the simulated bus keeps up with using edge events.
+static const int bitrate = 8000;
+
+// How long each workload runs for.
+static const std::chrono::seconds workload_time(2);
+
+// How long the fairness workload runs for, long enough for each node to send a few dozen packets.
+static const std::chrono::seconds fairness_time(10);
+
+// Builds up a JSON object, one field at a time.
+class json_fields
+{
+public:
+    template <typename T>
+    json_fields &add(const char *name, const T &value)
+    {
+        std::ostringstream field;
+        field << "\"" << name << "\":" << value;
+        fields.push_back(field.str());
+        return *this;
+    }
+    
+    json_fields &add(const char *name, const char *value)
+    {
+        return add(name, std::string("\"") + value + "\"");
+    }
+    
+    // Prints the object on a line of its own.
+    void print()
+    {
+        std::cout << "{";
+        for (std::size_t i = 0; i < fields.size(); i++)
+            std::cout << (i ? "," : "") << fields[i];
+        std::cout << "}" << std::endl;
+    }
+
+private:
+    std::vector<std::string> fields;
+};
+
+// Sum of the bytes read back in the ring workload, so that the reads aren't optimised away.
+volatile uint64_t ring_checksum;
+
+// Returns the CPU time used by the process so far, in seconds.
+static double process_cpu_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Returns a percentile (from 0 to 100) of some sorted values, or 0 if there aren't any.
+static double percentile(const std::vector<double> &sorted, int percent)
+{
+    if (sorted.empty())
+        return 0;
+    return sorted[std::min(sorted.size() - 1, sorted.size() * percent / 100)];
+}
+
+void BusBenchmark::run()
+{
+    const int clock_rates[] = { 4000, 8000, 16000, 32000 };
+    for (int rate : clock_rates)
+    {
+        measure_clock(rate, true);
+        measure_clock(rate, false);
+    }
+    
+    measure_idle(false);
+    measure_idle(true);
+    
+    measure_ring(64);
+    measure_ring(256);
+    measure_allocations(64);
+    
+    const int sender_counts[] = { 1, 2, 4, 8 };
+    const std::size_t packet_sizes[] = { 16, 64, 256 };
+    
+    for (int senders : sender_counts)
+        for (std::size_t packet_size : packet_sizes)
+            measure_contention(senders, packet_size);
+    
+    double single_line_goodput = 0;
+    const int data_lines[] = { 1, 2, 4, 8 };
+    for (int lines : data_lines)
+    {
+        double goodput = measure_data_lines(lines, single_line_goodput);
+        if (lines == 1)
+            single_line_goodput = goodput;
+    }
+    
+    measure_fairness(false);
+    measure_fairness(true);
+}
+
+void BusBenchmark::measure_clock(int rate, bool thread_per_pulse)
+{
+    Serial::options opts;
+    opts.bitrate = rate;
+    opts.edge_events = true;
+    
+    // The bus is declared first, so that it outlives the nodes. The baseline only drives the clock, so it doesn't
+    // need the nodes:
+    SimulatedBus bus;
+    std::unique_ptr<Serial> sender, listener;
+    if (!thread_per_pulse)
+    {
+        sender.reset(new Serial(bus.connect(), pin_scl, pin_sda, opts));
+        listener.reset(new Serial(bus.connect(), pin_scl, pin_sda, opts));
+    }
+    
+    // Another node only watches the bus, timing the clock pulses within each frame (from one falling edge to the next)
+    // as the bus saw them:
+    std::unique_ptr<SimulatedBus::Node> watcher(bus.connect());
+    std::unique_ptr<EdgeSource> edges(watcher->edge_source(pin_scl, pin_sda));
+    std::vector<double> intervals;
+    uint64_t pulses = 0;
+    std::atomic<bool> watching(true);
+    std::thread watch([&] () {
+        EdgeSource::edge e;
+        bool scl = true, in_frame = false;
+        std::chrono::steady_clock::time_point last_fall;
+        while (watching)
+        {
+            if (!edges->wait_edge(e, 10000))
+                continue;
+            
+            if (e.pin == pin_scl)
+            {
+                scl = e.rising;
+                if (!e.rising)
+                {
+                    pulses++;
+                    if (in_frame && last_fall != std::chrono::steady_clock::time_point())
+                        intervals.push_back(std::chrono::duration<double, std::micro>(e.timestamp - last_fall).count());
+                    last_fall = e.timestamp;
+                }
+            }
+            else if (scl)
+            {
+                // Start and stop conditions:
+                in_frame = !e.rising;
+                last_fall = std::chrono::steady_clock::time_point();
+            }
+        }
+    });
+    
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    if (thread_per_pulse)
+    {
+        // Frames of as many pulses as a 64 byte packet, each pulse being a thread which waits half a period, pulls
+        // the clock low, waits another half and releases it, and the next one being started once it's done:
+        std::unique_ptr<SimulatedBus::Node> clock(bus.connect());
+        const useconds_t half_period = 500000 / rate;
+        while (std::chrono::steady_clock::now() < start + workload_time)
+        {
+            clock->set_level(pin_sda, false);
+            for (int i = 0; i < (1 + 64) * 8; i++)
+            {
+                std::thread pulse([&] () {
+                    usleep(half_period);
+                    clock->set_level(pin_scl, false);
+                    usleep(half_period);
+                    clock->set_level(pin_scl, true);
+                });
+                pulse.join();
+            }
+            clock->set_level(pin_sda, true);
+            usleep(half_period);
+        }
+    }
+    else
+    {
+        while (std::chrono::steady_clock::now() < start + workload_time)
+        {
+            while (sender->remaining() < 2 && sender->write(Serial::packet(64, 0x55)));
+            for (Serial::packet_view p = listener->peek_view(); !p.empty(); p = listener->peek_view())
+                listener->release();
+            usleep(1000);
+        }
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    watching = false;
+    watch.join();
+    
+    const double period = 1e6 / rate;
+    std::vector<double> jitter;
+    for (double interval : intervals)
+        jitter.push_back(std::fabs(interval - period));
+    std::sort(jitter.begin(), jitter.end());
+    
+    json_fields()
+        .add("workload", "clock")
+        .add("engine", thread_per_pulse ? "thread_per_pulse" : "engine_thread")
+        .add("bitrate", rate)
+        .add("pulses_per_s", pulses / seconds)
+        .add("period_us", period)
+        .add("jitter_p50_us", percentile(jitter, 50))
+        .add("jitter_p99_us", percentile(jitter, 99))
+        .add("jitter_max_us", jitter.empty() ? 0.0 : jitter.back())
+        .print();
+}
+
+void BusBenchmark::measure_idle(bool edge_events)
+{
+    Serial::options opts;
+    opts.bitrate = bitrate;
+    opts.edge_events = edge_events;
+    
+    // The bus is declared first, so that it outlives the nodes:
+    SimulatedBus bus;
+    Serial sender(bus.connect(), pin_scl, pin_sda, opts);
+    Serial listener(bus.connect(), pin_scl, pin_sda, opts);
+    
+    // Nothing is sent, so this is only the cost of waiting for the bus:
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    double cpu_start = process_cpu_seconds();
+    usleep(std::chrono::duration_cast<std::chrono::microseconds>(workload_time).count());
+    double cpu_seconds = process_cpu_seconds() - cpu_start;
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    
+    // Then the edges of a stream of packets:
+    start = std::chrono::steady_clock::now();
+    while (std::chrono::steady_clock::now() < start + workload_time)
+    {
+        while (sender.remaining() < 2 && sender.write(Serial::packet(64, 0x55)));
+        for (Serial::packet_view p = listener.peek_view(); !p.empty(); p = listener.peek_view())
+            listener.release();
+        usleep(1000);
+    }
+    
+    json_fields()
+        .add("workload", "idle")
+        .add("mode", edge_events ? "edge_events" : "polling")
+        .add("bitrate", bitrate)
+        .add("idle_cpu_percent", 100 * cpu_seconds / seconds)
+        .add("max_edge_latency_us", std::max(sender.max_edge_latency(), listener.max_edge_latency()))
+        .print();
+}
+
+void BusBenchmark::measure_ring(std::size_t packet_size)
+{
+    const int packets = 1000000;
+    PacketRing<> ring(64, Serial::max_packet_size);
+    std::vector<unsigned char> packet(packet_size, 0x55);
+    
+    // Written and read in place on the same thread:
+    long allocations_before = allocation_count();
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    uint64_t sum = 0;
+    for (int i = 0; i < packets; i++)
+    {
+        PacketRing<>::slot *slot = ring.reserve();
+        slot->set_size(packet_size);
+        std::copy(packet.begin(), packet.end(), slot->data());
+        ring.commit();
+        
+        sum += ring.front().view()[0];
+        ring.pop();
+    }
+    double nanos = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    long allocations = allocation_count() - allocations_before;
+    ring_checksum = sum;
+    
+    // Handed from one thread to another, each packet carrying the time it was committed. Only one packet is in
+    // the ring at a time, so that this is the time to hand it over rather than the time spent queueing:
+    const int handoffs = 100000;
+    std::vector<double> latencies;
+    latencies.reserve(handoffs);
+    std::thread reader([&] () {
+        for (int i = 0; i < handoffs; )
+        {
+            if (ring.empty())
+            {
+                std::this_thread::yield();
+                continue;
+            }
+            
+            std::chrono::steady_clock::time_point sent;
+            std::copy(ring.front().data(), ring.front().data() + sizeof(sent), (unsigned char *) &sent);
+            latencies.push_back(std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - sent).count());
+            ring.pop();
+            i++;
+        }
+    });
+    for (int i = 0; i < handoffs; )
+    {
+        if (!ring.empty())
+        {
+            std::this_thread::yield();
+            continue;
+        }
+        
+        PacketRing<>::slot *slot = ring.reserve();
+        slot->set_size(packet_size);
+        std::copy(packet.begin(), packet.end(), slot->data());
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        std::copy((unsigned char *) &now, (unsigned char *) &now + sizeof(now), slot->data());
+        ring.commit();
+        i++;
+    }
+    reader.join();
+    std::sort(latencies.begin(), latencies.end());
+    
+    json_fields()
+        .add("workload", "ring")
+        .add("packet_bytes", packet_size)
+        .add("ns_per_packet", nanos / packets)
+        .add("allocations_per_packet", (double) allocations / packets)
+        .add("handoff_p50_ns", percentile(latencies, 50))
+        .add("handoff_p99_ns", percentile(latencies, 99))
+        .print();
+}
+
+void BusBenchmark::measure_allocations(std::size_t packet_size)
+{
+    Serial::options opts;
+    opts.bitrate = bitrate;
+    opts.edge_events = true;
+    
+    // The bus is declared first, so that it outlives the nodes:
+    SimulatedBus bus;
+    Serial sender(bus.connect(), pin_scl, pin_sda, opts);
+    Serial listener(bus.connect(), pin_scl, pin_sda, opts);
+    
+    // Keeps a couple of packets waiting on the sender, and reads everything received, returning the packets read:
+    auto pump = [&] () {
+        while (sender.remaining() < 2)
+        {
+            unsigned char *slot = sender.begin_write();
+            if (!slot)
+                break;
+            std::fill(slot, slot + packet_size, 0x55);
+            sender.end_write(packet_size);
+        }
+        
+        int read = 0;
+        for (Serial::packet_view p = listener.peek_view(); !p.empty(); p = listener.peek_view())
+        {
+            listener.release();
+            read++;
+        }
+        return read;
+    };
+    
+    // Let the threads and buffers settle first:
+    for (int warm = 0; warm < 10; )
+    {
+        warm += pump();
+        usleep(1000);
+    }
+    
+    long allocations_before = allocation_count();
+    int received = 0;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    while (std::chrono::steady_clock::now() < start + workload_time)
+    {
+        received += pump();
+        usleep(1000);
+    }
+    long allocations = allocation_count() - allocations_before;
+    
+    json_fields()
+        .add("workload", "allocations")
+        .add("bitrate", bitrate)
+        .add("packet_bytes", packet_size)
+        .add("packets", received)
+        .add("allocations_per_packet", received ? (double) allocations / received : 0.0)
+        .print();
+}
+
+void BusBenchmark::measure_contention(int senders, std::size_t packet_size)
+{
+    Serial::options opts;
+    opts.bitrate = bitrate;
+    opts.edge_events = true;
+    
+    // Node 0 only listens. The bus is declared first, so that it outlives the nodes:
+    SimulatedBus bus;
+    std::vector<std::unique_ptr<Serial>> nodes;
+    for (int i = 0; i <= senders; i++)
+        nodes.emplace_back(new Serial(bus.connect(), pin_scl, pin_sda, opts));
+    
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::chrono::steady_clock::time_point end = start + workload_time;
+    std::vector<double> latencies;
+    
+    while (std::chrono::steady_clock::now() < end)
+    {
+        uint32_t micros = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+        
+        // Keep a couple of packets waiting on each sender, each carrying its sender and the time it was written:
+        for (int i = 1; i <= senders; i++)
+        {
+            while (nodes[i]->remaining() < 2)
+            {
+                unsigned char *slot = nodes[i]->begin_write();
+                if (!slot)
+                    break;
+                
+                slot[0] = i;
+                for (int b = 0; b < 4; b++)
+                    slot[1 + b] = (micros >> (8 * b)) & 0xFF;
+                for (std::size_t b = 5; b < packet_size; b++)
+                    slot[b] = b;
+                nodes[i]->end_write(packet_size);
+            }
+        }
+        
+        // Read everything received, only timing the packets received by the listening node:
+        for (std::size_t i = 0; i < nodes.size(); i++)
+        {
+            for (Serial::packet_view p = nodes[i]->peek_view(); !p.empty(); p = nodes[i]->peek_view())
+            {
+                if (i == 0 && p.size() >= 5)
+                {
+                    uint32_t sent = p[1] | (p[2] << 8) | (p[3] << 16) | ((uint32_t) p[4] << 24);
+                    uint32_t now = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+                    latencies.push_back((now - sent) / 1000.0);
+                }
+                nodes[i]->release();
+            }
+        }
+        
+        usleep(1000);
+    }
+    
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    
+    uint64_t sent = 0, lost = 0;
+    for (int i = 1; i <= senders; i++)
+    {
+        Serial::stats stats = nodes[i]->statistics();
+        sent += stats.frames_sent;
+        lost += stats.arbitration_lost;
+    }
+    Serial::stats listener = nodes[0]->statistics();
+    std::sort(latencies.begin(), latencies.end());
+    
+    json_fields()
+        .add("workload", "contention")
+        .add("bitrate", bitrate)
+        .add("senders", senders)
+        .add("packet_bytes", packet_size)
+        .add("packets_per_s", latencies.size() / seconds)
+        .add("bits_per_s", listener.bits / seconds)
+        .add("arbitration_loss_rate", sent + lost ? (double) lost / (sent + lost) : 0.0)
+        .add("latency_p50_ms", percentile(latencies, 50))
+        .add("latency_p99_ms", percentile(latencies, 99))
+        .print();
+}
+
+double BusBenchmark::measure_data_lines(int lines, double single_line_goodput)
+{
+    const int rate = 4000;
+    const std::size_t packet_size = 100;
+    
+    // The extra data lines follow the clock and the first data line:
+    Serial::options opts;
+    opts.bitrate = rate;
+    opts.edge_events = true;
+    for (int i = 1; i < lines; i++)
+        opts.extra_data_pins.push_back(pin_sda + i);
+    
+    SimulatedBus bus;
+    Serial sender(bus.connect(), pin_scl, pin_sda, opts);
+    Serial listener(bus.connect(), pin_scl, pin_sda, opts);
+    
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    uint64_t received = 0;
+    while (std::chrono::steady_clock::now() < start + workload_time)
+    {
+        while (sender.remaining() < 2 && sender.write(Serial::packet(packet_size, 0x5A)));
+        for (Serial::packet_view p = listener.peek_view(); !p.empty(); p = listener.peek_view())
+        {
+            received += p.size();
+            listener.release();
+        }
+        usleep(1000);
+    }
+    
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    double goodput = received / seconds;
+    
+    json_fields()
+        .add("workload", "data_lines")
+        .add("bitrate", rate)
+        .add("data_lines", lines)
+        .add("packet_bytes", packet_size)
+        .add("goodput_bytes_per_s", goodput)
+        .add("speedup", single_line_goodput > 0 ? goodput / single_line_goodput : 1.0)
+        .print();
+    return goodput;
+}
+
+void BusBenchmark::measure_fairness(bool managed)
+{
+    const int senders = 8;
+    const std::chrono::milliseconds interactive_interval(40);
+    
+    Serial::options opts;
+    opts.bitrate = bitrate;
+    opts.edge_events = true;
+    opts.fair_access = managed;
+    opts.priorities = managed;
+    
+    // Node 0 only listens, node 1 sends the interactive packets. The bus is declared first, so that it outlives the nodes:
+    SimulatedBus bus;
+    std::vector<std::unique_ptr<Serial>> nodes;
+    for (int i = 0; i <= senders; i++)
+        nodes.emplace_back(new Serial(bus.connect(), pin_scl, pin_sda, opts));
+    
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::chrono::steady_clock::time_point end = start + fairness_time;
+    std::chrono::steady_clock::time_point next_interactive = start;
+    std::vector<uint64_t> received(senders + 1, 0);
+    std::vector<double> busy_latencies, interactive_latencies;
+    
+    while (std::chrono::steady_clock::now() < end)
+    {
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        uint32_t micros = std::chrono::duration_cast<std::chrono::microseconds>(now - start).count();
+        
+        // Each packet carries its sender and the time it was written:
+        for (int i = 1; i <= senders; i++)
+        {
+            bool interactive = i == 1;
+            if (interactive ? now < next_interactive : nodes[i]->remaining() >= 2)
+                continue;
+            
+            Serial::packet packet(interactive ? 12 : 32);
+            packet[0] = i;
+            for (int b = 0; b < 4; b++)
+                packet[1 + b] = (micros >> (8 * b)) & 0xFF;
+            for (std::size_t b = 5; b < packet.size(); b++)
+                packet[b] = b;
+            nodes[i]->write_prioritized(packet, interactive ? Serial::priority_interactive : Serial::priority_bulk);
+            if (interactive)
+                next_interactive += interactive_interval;
+        }
+        
+        for (std::size_t i = 0; i < nodes.size(); i++)
+        {
+            for (Serial::packet_view p = nodes[i]->peek_view(); !p.empty(); p = nodes[i]->peek_view())
+            {
+                if (i == 0 && p.size() >= 5 && p[0] >= 1 && p[0] <= senders)
+                {
+                    uint32_t sent = p[1] | (p[2] << 8) | (p[3] << 16) | ((uint32_t) p[4] << 24);
+                    uint32_t now = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+                    (p[0] == 1 ? interactive_latencies : busy_latencies).push_back((now - sent) / 1000.0);
+                    received[p[0]]++;
+                }
+                nodes[i]->release();
+            }
+        }
+        
+        usleep(1000);
+    }
+    
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    
+    // Jain's index is 1 when the busy nodes all get the same share of the bus, and 1/n when one node gets all of it:
+    std::ostringstream rates;
+    double total = 0, squares = 0;
+    for (int i = 1; i <= senders; i++)
+    {
+        rates << (i > 1 ? "," : "[") << received[i] / seconds;
+        if (i > 1)
+        {
+            total += received[i];
+            squares += (double) received[i] * received[i];
+        }
+    }
+    rates << "]";
+    
+    std::sort(busy_latencies.begin(), busy_latencies.end());
+    std::sort(interactive_latencies.begin(), interactive_latencies.end());
+    
+    json_fields()
+        .add("workload", "fairness")
+        .add("bitrate", bitrate)
+        .add("fair_access", std::string(managed ? "true" : "false"))
+        .add("priorities", std::string(managed ? "true" : "false"))
+        .add("packets_per_s", rates.str())
+        .add("jain_index", squares > 0 ? total * total / ((senders - 1) * squares) : 0.0)
+        .add("latency_p50_ms", percentile(busy_latencies, 50))
+        .add("latency_p99_ms", percentile(busy_latencies, 99))
+        .add("interactive_latency_p50_ms", percentile(interactive_latencies, 50))
+        .add("interactive_latency_p99_ms", percentile(interactive_latencies, 99))
+        .print();
+}
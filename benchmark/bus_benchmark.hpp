@@ -0,0 +1,67 @@
+#ifndef BUS_BENCHMARK_HPP
+#define BUS_BENCHMARK_HPP
+
+#include <cstddef>
+
+/**
+ * Measures the bus on a 'SimulatedBus', with several 'Serial' instances in the process contending for it just like
+ * boards on real wires, printing one JSON object per workload to the standard output.
+ */
+class BusBenchmark
+{
+public:
+    /**
+     * Runs all the workloads.
+     */
+    static void run();
+
+private:
+    /**
+     * Has one node send packets as fast as it can at the given bitrate, and prints the clock pulses per second
+     * and the jitter of the clock: how far the time between two pulses of a frame is from the clock period,
+     * as seen by another node watching the bus. The clock is either generated by 'Serial''s engine thread or,
+     * as a baseline, by a new thread for each pulse as 'Serial' used to.
+     */
+    static void measure_clock(int rate, bool thread_per_pulse);
+    
+    /**
+     * Leaves two nodes idle, polling the pins or waiting for edge events, and prints the share of a core
+     * they use. Then has one send to the other for a while and prints the worst delay between an edge and its
+     * handler being run (only measured with edge events).
+     */
+    static void measure_idle(bool edge_events);
+    
+    /**
+     * Passes packets through a 'PacketRing' on one thread, and from one thread to another, and prints the time
+     * and heap allocations per packet and the latency of the handoff between threads.
+     */
+    static void measure_ring(std::size_t packet_size);
+    
+    /**
+     * Streams packets from one node to another once they've warmed up, writing and reading them in place,
+     * and prints the heap allocations per packet made by the whole process.
+     */
+    static void measure_allocations(std::size_t packet_size);
+    
+    /**
+     * Has the given number of nodes send packets of the given size as fast as they can, to another node which only
+     * listens, and prints the packets and bits per second, the share of transmissions which lost arbitration,
+     * and the latency from writing a packet to it being read on the other side.
+     */
+    static void measure_contention(int senders, std::size_t packet_size);
+    
+    /**
+     * Has one node send packets as fast as it can over the given number of data lines, and prints the goodput
+     * and its ratio to the given goodput of a single line (0 when measuring that). Returns the goodput.
+     */
+    static double measure_data_lines(int lines, double single_line_goodput);
+    
+    /**
+     * Has 7 nodes send packets as fast as they can while another sends a small interactive packet every 40 ms,
+     * with fair access and priorities both off or both on, and prints the packets per second of each node, the Jain's
+     * fairness index of the busy nodes, and the latency from writing a packet to it being read for both kinds of node.
+     */
+    static void measure_fairness(bool managed);
+};
+
+#endif /* BUS_BENCHMARK_HPP */
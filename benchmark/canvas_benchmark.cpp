@@ -0,0 +1,944 @@
+#include "canvas_benchmark.h"
+#include "canvas.h"
+#include "decoder.h"
+#include "journal.hpp"
+#include "simulated_bus.hpp"
+#include "allocation_count.hpp"
+
+#include <QApplication>
+#include <QElapsedTimer>
+#include <QFileInfo>
+#include <QStringList>
+#include <QTemporaryDir>
+#include <QLine>
+#include <QList>
+#include <QMouseEvent>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <iostream>
+#include <random>
+#include <algorithm>
+#include <cmath>
+
+// Allocations per segment between two counts.
+static QString allocationsPerSegment(long before, long after, int segments)
+{
+    if(segments == 0)
+        return "0";
+    return QString::number((double) (after - before) / segments, 'f', 3);
+}
+
+// Percentile of some sorted times.
+static qint64 percentile(const QVector<qint64> &sorted, int percent)
+{
+    if(sorted.isEmpty())
+        return 0;
+    return sorted[qMin(sorted.size() - 1, sorted.size() * percent / 100)];
+}
+
+// Packets of a pen stroke in the encoding used before delta encoding (command 1): the colour, then each point's
+// absolute coordinates, with 63 points in a packet of 256 bytes and each packet starting where the last one ended.
+static QList<Serial::packet> absolutePackets(const QVector<QPoint> &stroke, const QColor &color)
+{
+    QList<Serial::packet> packets;
+    for(int from = 0; from + 1 < stroke.size(); from += 62)
+    {
+        Serial::packet p;
+        p.push_back(1);
+        p.push_back(color.red() & 0xFF);
+        p.push_back(color.green() & 0xFF);
+        p.push_back(color.blue() & 0xFF);
+        for(int i = from; i < stroke.size() && i <= from + 62; i++)
+        {
+            p.push_back(stroke[i].x() & 0xFF);
+            p.push_back((stroke[i].x() >> 8) & 0xFF);
+            p.push_back(stroke[i].y() & 0xFF);
+            p.push_back((stroke[i].y() >> 8) & 0xFF);
+        }
+        packets.append(p);
+    }
+    return packets;
+}
+
+// Microseconds taken to send some packets from one board to another on the simulated bus, from writing the first
+// to reading the last.
+static qint64 transferMicros(const QList<Serial::packet> &packets, const Serial::options &opts)
+{
+    SimulatedBus bus;
+    Serial sender(bus.connect(), 0, 1, opts);
+    Serial receiver(bus.connect(), 0, 1, opts);
+    
+    QElapsedTimer timer;
+    timer.start();
+    for(int written = 0, received = 0; received < packets.size(); )
+    {
+        while(written < packets.size() && sender.write(packets[written]))
+            written++;
+        for(Serial::packet_view p = receiver.peek_view(); !p.empty(); p = receiver.peek_view())
+        {
+            receiver.release();
+            received++;
+        }
+        usleep(1000);
+    }
+    return timer.nsecsElapsed() / 1000;
+}
+
+int CanvasBenchmark::run(const QString &journalPath)
+{
+    const int workloads[] = { 10, 100, 1000, 10000, 100000 };
+    for(int segments : workloads)
+        measure("synthetic", syntheticStrokes(segments));
+    
+    measureLayout(10000);
+    
+    // The input stage with a repaint for every pointer movement (as it used to be), with its defaults, and smoothed:
+    measureInput("input_uncoalesced", false, 0, 0);
+    measureInput("input_resampled", true, 3, 0);
+    measureInput("input_smoothed", true, 3, 0.5);
+    
+    measureStreaming(0);
+    measureStreaming(100);
+    
+    // A session of strokes drawn one after another, streamed with and without replacing the chunks waiting for the bus:
+    Strokes session = syntheticStrokes(200 * 5, 200);
+    measureReplay("synthetic", session, false);
+    measureReplay("synthetic", session, true);
+    
+    measureBurst(1000);
+    measureStall(false);
+    measureStall(true);
+    
+    // Strokes chunked into packets of up to 256 bytes, and sent whole with extended length framing:
+    const int strokeSegments[] = { 10, 50, 250 };
+    for(int segments : strokeSegments)
+    {
+        measureFraming(false, segments);
+        measureFraming(true, segments);
+    }
+    
+    measureJournal(100000);
+    measureSync(5000);
+    
+    if(!journalPath.isEmpty())
+    {
+        if(!QFileInfo::exists(journalPath))
+        {
+            std::cerr << "No journal at " << journalPath.toStdString() << std::endl;
+            return 1;
+        }
+        Strokes recorded = recordedStrokes(journalPath);
+        measure("recorded", recorded);
+        
+        // Only the start of the session is drawn again, as it's drawn in real time:
+        recorded = recorded.mid(0, 10);
+        measureReplay("recorded", recorded, false);
+        measureReplay("recorded", recorded, true);
+    }
+    return 0;
+}
+
+CanvasBenchmark::Strokes CanvasBenchmark::syntheticStrokes(int segments, int strokeSegments)
+{
+    // Wandering strokes of up to the given length, the same every time for the same number of segments:
+    std::mt19937 random(segments);
+    std::uniform_int_distribution<int> step(-6, 6);
+    
+    Strokes strokes;
+    while(segments > 0)
+    {
+        int length = qMin(segments, strokeSegments);
+        segments -= length;
+        
+        QVector<QPoint> stroke;
+        stroke.reserve(length + 1);
+        stroke.append(QPoint(random() % 1280, random() % 800));
+        for(int i = 0; i < length; i++)
+        {
+            QPoint point = stroke.last() + QPoint(step(random), step(random));
+            stroke.append(QPoint(qBound(0, point.x(), 1279), qBound(0, point.y(), 799)));
+        }
+        strokes.append(stroke);
+    }
+    return strokes;
+}
+
+CanvasBenchmark::Strokes CanvasBenchmark::recordedStrokes(const QString &journalPath)
+{
+    // Rebuild the board from the journal, and take the pen strokes from it:
+    canvas board;
+    Journal journal(journalPath.toStdString());
+    journal.replay([&board] (const Serial::packet_view &p) {
+        board.deserialize(p);
+    });
+    
+    Strokes strokes;
+    for(int i = 0; i < board.lines.size(); i++)
+        if(board.lines[i].shape == canvas::LineGroup::Polyline && board.lines[i].points.size() >= 2)
+            strokes.append(board.lines[i].points);
+    return strokes;
+}
+
+void CanvasBenchmark::measure(const QString &workload, const Strokes &strokes)
+{
+    int segments = 0;
+    for(int i = 0; i < strokes.size(); i++)
+        segments += strokes[i].size() - 1;
+    
+    QElapsedTimer timer;
+    long allocationsBefore;
+    
+    // Encoding each stroke into packets, as it's done once the pen is lifted:
+    canvas encoder;
+    encoder.toolType = "pen";
+    encoder.currentLines.color = Qt::black;
+    
+    QList<Serial::packet> packets;
+    QVector<int> strokePackets; // number of packets for each stroke
+    qint64 bytes = 0;
+    
+    allocationsBefore = allocation_count();
+    timer.start();
+    for(int i = 0; i < strokes.size(); i++)
+    {
+        encoder.currentLines.points = strokes[i];
+        QList<Serial::packet> encoded = encoder.serialize();
+        packets += encoded;
+        strokePackets.append(encoded.size());
+    }
+    qint64 encodeNanos = timer.nsecsElapsed();
+    QString encodeAllocations = allocationsPerSegment(allocationsBefore, allocation_count(), segments);
+    
+    for(int i = 0; i < packets.size(); i++)
+        bytes += packets[i].size();
+    
+    // The same strokes in the encoding used before delta encoding, and both sent over the bus at the default bitrate.
+    // Only the first hundred segments or so are sent, as that takes seconds already:
+    const int transferSegments = 100;
+    QList<Serial::packet> transferPackets, absoluteTransferPackets;
+    qint64 absoluteBytes = 0;
+    int sentSegments = 0;
+    for(int i = 0, next = 0; i < strokes.size(); i++)
+    {
+        QList<Serial::packet> absolute = absolutePackets(strokes[i], encoder.currentLines.color);
+        for(int j = 0; j < absolute.size(); j++)
+            absoluteBytes += absolute[j].size();
+        
+        if(sentSegments < transferSegments)
+        {
+            sentSegments += strokes[i].size() - 1;
+            absoluteTransferPackets += absolute;
+            transferPackets += packets.mid(next, strokePackets[i]);
+        }
+        next += strokePackets[i];
+    }
+    
+    Serial::options transferOptions;
+    transferOptions.edge_events = true;
+    qint64 transferMillis = transferMicros(transferPackets, transferOptions) / 1000;
+    qint64 absoluteTransferMillis = transferMicros(absoluteTransferPackets, transferOptions) / 1000;
+    
+    // Decoding the packets, without painting:
+    canvas decoder;
+    
+    allocationsBefore = allocation_count();
+    timer.restart();
+    for(int i = 0; i < packets.size(); i++)
+    {
+        Serial::packet_view p;
+        p.data = packets[i].data();
+        p.length = packets[i].size();
+        decoder.deserialize(p);
+    }
+    qint64 decodeNanos = timer.nsecsElapsed();
+    QString decodeAllocations = allocationsPerSegment(allocationsBefore, allocation_count(), segments);
+    
+    // Painting each stroke as it's received, only repainting the area it covers:
+    canvas painted;
+    painted.resize(1280, 800);
+    painted.show();
+    QApplication::processEvents();
+    
+    QVector<qint64> frames;
+    frames.reserve(strokes.size());
+    for(int i = 0, next = 0; i < strokes.size(); i++)
+    {
+        for(int end = next + strokePackets[i]; next < end; next++)
+        {
+            Serial::packet_view p;
+            p.data = packets[next].data();
+            p.length = packets[next].size();
+            painted.deserialize(p);
+        }
+        if(painted.lines.isEmpty())
+            continue;
+        
+        timer.restart();
+        painted.repaint(painted.lines.last().bounds.adjusted(-2, -2, 2, 2));
+        frames.append(timer.nsecsElapsed() / 1000);
+    }
+    std::sort(frames.begin(), frames.end());
+    
+    // Painting everything from scratch, as after a resize:
+    painted.committedLayer = QImage();
+    timer.restart();
+    painted.repaint();
+    qint64 fullPaintMicros = timer.nsecsElapsed() / 1000;
+    painted.hide();
+    
+    QStringList fields;
+    fields << QString("\"workload\":\"%1\"").arg(workload);
+    fields << QString("\"segments\":%1").arg(segments);
+    fields << QString("\"strokes\":%1").arg(strokes.size());
+    fields << QString("\"packets\":%1").arg(packets.size());
+    fields << QString("\"bytes\":%1").arg(bytes);
+    fields << QString("\"command1_bytes\":%1").arg(absoluteBytes);
+    fields << QString("\"transfer_bitrate\":%1").arg(transferOptions.bitrate);
+    fields << QString("\"transfer_segments\":%1").arg(sentSegments);
+    fields << QString("\"transfer_ms\":%1").arg(transferMillis);
+    fields << QString("\"command1_transfer_ms\":%1").arg(absoluteTransferMillis);
+    fields << QString("\"serialize_segments_per_s\":%1").arg(segments * 1e9 / qMax<qint64>(encodeNanos, 1), 0, 'f', 0);
+    fields << QString("\"serialize_allocations_per_segment\":%1").arg(encodeAllocations);
+    fields << QString("\"deserialize_segments_per_s\":%1").arg(segments * 1e9 / qMax<qint64>(decodeNanos, 1), 0, 'f', 0);
+    fields << QString("\"deserialize_allocations_per_segment\":%1").arg(decodeAllocations);
+    fields << QString("\"frames\":%1").arg(frames.size());
+    fields << QString("\"frame_p50_us\":%1").arg(percentile(frames, 50));
+    fields << QString("\"frame_p99_us\":%1").arg(percentile(frames, 99));
+    fields << QString("\"full_paint_us\":%1").arg(fullPaintMicros);
+    
+    std::cout << "{" << fields.join(",").toStdString() << "}" << std::endl;
+}
+
+void CanvasBenchmark::measureLayout(int strokeCount)
+{
+    Strokes strokes = syntheticStrokes(50 * strokeCount);
+    QElapsedTimer timer;
+    
+    // Groups as they're stored now, with the points in one array:
+    long bytesBefore = allocated_bytes();
+    QVector<canvas::LineGroup> groups;
+    for(int i = 0; i < strokes.size(); i++)
+    {
+        canvas::LineGroup group;
+        group.color = Qt::black;
+        group.points = strokes[i];
+        group.points.detach();
+        group.updateBounds();
+        groups.append(group);
+    }
+    long pointBytes = allocated_bytes() - bytesBefore;
+    
+    // Groups as they used to be stored, with a heap node for each line:
+    struct LegacyGroup
+    {
+        QColor color;
+        QBrush brush;
+        QList<QLine> lines;
+        QRect bounds;
+    };
+    bytesBefore = allocated_bytes();
+    QList<LegacyGroup> legacyGroups;
+    for(int i = 0; i < strokes.size(); i++)
+    {
+        LegacyGroup group;
+        group.color = Qt::black;
+        for(int j = 1; j < strokes[i].size(); j++)
+            group.lines.append(QLine(strokes[i][j - 1], strokes[i][j]));
+        group.bounds = groups[i].bounds;
+        legacyGroups.append(group);
+    }
+    long lineBytes = allocated_bytes() - bytesBefore;
+    
+    // Painting all the groups onto an image, as the cached layer is rebuilt, with a polyline per group
+    // and (as it used to be) a line at a time:
+    canvas board;
+    QImage image(1280, 800, QImage::Format_ARGB32_Premultiplied);
+    image.fill(Qt::transparent);
+    {
+        QPainter painter(&image);
+        timer.start();
+        for(int i = 0; i < groups.size(); i++)
+            board.drawGroup(painter, groups[i]);
+    }
+    qint64 pointPaintMicros = timer.nsecsElapsed() / 1000;
+    
+    image.fill(Qt::transparent);
+    {
+        QPainter painter(&image);
+        timer.start();
+        for(int i = 0; i < legacyGroups.size(); i++)
+        {
+            QPen pen;
+            pen.setColor(legacyGroups[i].color);
+            painter.setPen(pen);
+            for(int j = 0; j < legacyGroups[i].lines.size(); j++)
+                painter.drawLine(legacyGroups[i].lines[j]);
+        }
+    }
+    qint64 linePaintMicros = timer.nsecsElapsed() / 1000;
+    
+    QStringList fields;
+    fields << QString("\"workload\":\"layout\"");
+    fields << QString("\"strokes\":%1").arg(strokes.size());
+    fields << QString("\"point_array_bytes\":%1").arg(pointBytes);
+    fields << QString("\"line_list_bytes\":%1").arg(lineBytes);
+    fields << QString("\"point_array_paint_us\":%1").arg(pointPaintMicros);
+    fields << QString("\"line_list_paint_us\":%1").arg(linePaintMicros);
+    
+    std::cout << "{" << fields.join(",").toStdString() << "}" << std::endl;
+}
+
+void CanvasBenchmark::measureInput(const QString &workload, bool coalesce, double resampleStep, double smoothing)
+{
+    // Ten seconds of a pointer reporting every 5 ms, wandering by a few pixels each time with some jitter:
+    const int eventCount = 2000;
+    const double eventMillis = 5, frameMillis = 1000.0 / 60;
+    std::mt19937 random(eventCount);
+    std::uniform_real_distribution<double> turn(-0.3, 0.3);
+    std::uniform_int_distribution<int> jitter(-1, 1);
+    
+    QVector<QPoint> events;
+    events.reserve(eventCount);
+    QPointF position(640, 400);
+    double angle = 0;
+    for(int i = 0; i < eventCount; i++)
+    {
+        angle += turn(random);
+        position += QPointF(std::cos(angle), std::sin(angle)) * 3;
+        position = QPointF(qBound(0.0, position.x(), 1279.0), qBound(0.0, position.y(), 799.0));
+        events.append(position.toPoint() + QPoint(jitter(random), jitter(random)));
+    }
+    
+    canvas board;
+    board.toolType = "pen";
+    board.currentLines.color = Qt::black;
+    board.streamInterval = 0;
+    board.setInputFiltering(resampleStep, smoothing);
+    board.resize(1280, 800);
+    board.show();
+    QApplication::processEvents();
+    
+    // Each frame adds the movements since the last one (or a single movement when not coalescing), and repaints:
+    QElapsedTimer timer;
+    QVector<qint64> frames;
+    frames.reserve(eventCount);
+    for(int i = 0, frame = 1; i < eventCount; frame++)
+    {
+        int end = coalesce ? qMin(eventCount, (int) std::ceil(frame * frameMillis / eventMillis)) : i + 1;
+        for(; i < end; i++)
+        {
+            board.pendingInput.append(events[i]);
+            board.lastInput = events[i];
+            board.inputEvents++;
+        }
+        
+        timer.restart();
+        board.processInput();
+        QApplication::processEvents();
+        frames.append(timer.nsecsElapsed() / 1000);
+    }
+    board.finishInput();
+    std::sort(frames.begin(), frames.end());
+    
+    // What would be sent once the pen is lifted:
+    int keptPoints = board.currentLines.points.size();
+    board.currentLines.points = board.simplifyStroke(board.currentLines.points);
+    QList<Serial::packet> packets = board.serialize();
+    qint64 bytes = 0;
+    for(int i = 0; i < packets.size(); i++)
+        bytes += packets[i].size();
+    board.hide();
+    
+    QStringList fields;
+    fields << QString("\"workload\":\"%1\"").arg(workload);
+    fields << QString("\"resample_px\":%1").arg(resampleStep);
+    fields << QString("\"smoothing\":%1").arg(smoothing);
+    fields << QString("\"events\":%1").arg(eventCount);
+    fields << QString("\"points\":%1").arg(keptPoints);
+    fields << QString("\"sent_points\":%1").arg(board.currentLines.points.size());
+    fields << QString("\"bytes\":%1").arg(bytes);
+    fields << QString("\"frames\":%1").arg(frames.size());
+    fields << QString("\"frame_p50_us\":%1").arg(percentile(frames, 50));
+    fields << QString("\"frame_p99_us\":%1").arg(percentile(frames, 99));
+    
+    std::cout << "{" << fields.join(",").toStdString() << "}" << std::endl;
+}
+
+void CanvasBenchmark::drawStroke(canvas &board, const QVector<QPoint> &stroke, const std::function<void()> &poll)
+{
+    const qint64 eventMillis = 5, frameMillis = 16;
+    
+    QElapsedTimer timer;
+    timer.start();
+    for(int next = 0, frame = 1; next < stroke.size(); )
+    {
+        qint64 now = timer.elapsed();
+        for(; next < stroke.size() && next * eventMillis <= now; next++)
+        {
+            board.pendingInput.append(stroke[next]);
+            board.lastInput = stroke[next];
+            board.inputEvents++;
+        }
+        if(now >= frame * frameMillis)
+        {
+            board.processInput();
+            frame++;
+        }
+        
+        QApplication::processEvents();
+        poll();
+        usleep(1000);
+    }
+    
+    QMouseEvent release(QEvent::MouseButtonRelease, stroke.last(), Qt::LeftButton, Qt::LeftButton, Qt::NoModifier);
+    board.mouseReleaseEvent(&release);
+}
+
+void CanvasBenchmark::measureStreaming(int streamInterval)
+{
+    const int strokeCount = 3;
+    
+    Serial::options opts;
+    opts.edge_events = true;
+    
+    // The bus and the nodes are declared first, so that they outlive the canvases using them:
+    SimulatedBus bus;
+    Serial senderSerial(bus.connect(), 0, 1, opts);
+    Serial receiverSerial(bus.connect(), 0, 1, opts);
+    
+    canvas sender;
+    sender.toolType = "pen";
+    sender.currentLines.color = Qt::black;
+    sender.setStreaming(streamInterval);
+    sender.setSerial(&senderSerial);
+    QObject::connect(&sender, &canvas::sendPacket, &senderSerial, &Serial::write_prioritized);
+    canvas receiver;
+    receiver.setSerial(&receiverSerial);
+    
+    // Each stroke is timed from the pen going down until the receiving board shows it, and from the pen
+    // being lifted until the receiving board has all of it:
+    Strokes strokes = syntheticStrokes(200 * strokeCount, 200);
+    QVector<qint64> firstLatencies, lastLatencies;
+    QElapsedTimer timer;
+    for(int i = 0; i < strokes.size(); i++)
+    {
+        qint64 firstSeen = -1;
+        auto poll = [&] () {
+            if(firstSeen < 0 && receiver.lines.size() > i)
+                firstSeen = timer.elapsed();
+        };
+        
+        timer.start();
+        drawStroke(sender, strokes[i], poll);
+        qint64 released = timer.elapsed();
+        
+        while(!(receiver.lines.size() > i && receiver.openStrokes.isEmpty()) && timer.elapsed() < 60000)
+        {
+            QApplication::processEvents();
+            poll();
+            usleep(1000);
+        }
+        if(receiver.lines.size() > i && receiver.openStrokes.isEmpty())
+        {
+            firstLatencies.append(firstSeen);
+            lastLatencies.append(timer.elapsed() - released);
+        }
+    }
+    std::sort(firstLatencies.begin(), firstLatencies.end());
+    std::sort(lastLatencies.begin(), lastLatencies.end());
+    
+    QStringList fields;
+    fields << QString("\"workload\":\"streaming\"");
+    fields << QString("\"stream_interval_ms\":%1").arg(streamInterval);
+    fields << QString("\"bitrate\":%1").arg(opts.bitrate);
+    fields << QString("\"strokes\":%1").arg(lastLatencies.size());
+    fields << QString("\"first_segment_ms\":%1").arg(percentile(firstLatencies, 50));
+    fields << QString("\"last_segment_ms\":%1").arg(percentile(lastLatencies, 50));
+    
+    std::cout << "{" << fields.join(",").toStdString() << "}" << std::endl;
+}
+
+void CanvasBenchmark::measureReplay(const QString &workload, const Strokes &strokes, bool replace)
+{
+    Serial::options opts;
+    opts.edge_events = true;
+    
+    // The bus and the nodes are declared first, so that they outlive the canvases using them:
+    SimulatedBus bus;
+    Serial senderSerial(bus.connect(), 0, 1, opts);
+    Serial receiverSerial(bus.connect(), 0, 1, opts);
+    
+    // The drawing board only replaces the chunks still waiting for the bus when it knows the serial instance:
+    canvas sender;
+    sender.toolType = "pen";
+    sender.currentLines.color = Qt::black;
+    sender.setStreaming(100);
+    if(replace)
+        sender.setSerial(&senderSerial);
+    QObject::connect(&sender, &canvas::sendPacket, &senderSerial, &Serial::write_prioritized);
+    canvas receiver;
+    receiver.setSerial(&receiverSerial);
+    
+    // The strokes are drawn one after another, then the bus is left to catch up:
+    QElapsedTimer timer;
+    timer.start();
+    for(int i = 0; i < strokes.size(); i++)
+        drawStroke(sender, strokes[i], [] () {});
+    qint64 drawnMillis = timer.elapsed();
+    while(!(receiver.lines.size() == strokes.size() && receiver.openStrokes.isEmpty()) && timer.elapsed() < 600000)
+    {
+        QApplication::processEvents();
+        usleep(1000);
+    }
+    qint64 totalMillis = timer.elapsed();
+    
+    // Every node counts all the bits clocked on the bus, so the bus time is the sender's count at the nominal bitrate:
+    Serial::stats stats = senderSerial.statistics();
+    
+    QStringList fields;
+    fields << QString("\"workload\":\"replay_%1\"").arg(workload);
+    fields << QString("\"replace\":%1").arg(replace ? "true" : "false");
+    fields << QString("\"bitrate\":%1").arg(opts.bitrate);
+    fields << QString("\"strokes\":%1").arg(strokes.size());
+    fields << QString("\"frames_sent\":%1").arg(stats.frames_sent);
+    fields << QString("\"saved_bytes\":%1").arg(stats.bytes_saved);
+    fields << QString("\"bus_ms\":%1").arg(stats.bits * 1000 / opts.bitrate);
+    fields << QString("\"drawing_ms\":%1").arg(drawnMillis);
+    fields << QString("\"catch_up_ms\":%1").arg(totalMillis - drawnMillis);
+    
+    std::cout << "{" << fields.join(",").toStdString() << "}" << std::endl;
+}
+
+void CanvasBenchmark::measureBurst(int packetCount)
+{
+    // Strokes of 50 segments, each fitting in a packet:
+    QList<Serial::packet> packets;
+    canvas encoder;
+    encoder.toolType = "pen";
+    encoder.currentLines.color = Qt::black;
+    Strokes strokes = syntheticStrokes(50 * packetCount);
+    for(int i = 0; i < strokes.size() && packets.size() < packetCount; i++)
+    {
+        encoder.currentLines.points = strokes[i];
+        packets += encoder.serialize();
+    }
+    
+    QElapsedTimer timer;
+    
+    // Inline: the whole burst is decoded and painted before the GUI thread gets back to its events:
+    canvas inlineBoard;
+    inlineBoard.resize(1280, 800);
+    inlineBoard.show();
+    QApplication::processEvents();
+    
+    timer.start();
+    for(int i = 0; i < packets.size(); i++)
+    {
+        Serial::packet_view p;
+        p.data = packets[i].data();
+        p.length = packets[i].size();
+        inlineBoard.deserialize(p);
+    }
+    QApplication::processEvents();
+    qint64 inlineMicros = timer.nsecsElapsed() / 1000;
+    inlineBoard.hide();
+    
+    // Batched: the decoder's work is done off the GUI thread, which only merges each batch and repaints once for it:
+    PacketDecoder decoder;
+    QVector<QVector<canvas::DecodedPacket>> batches;
+    timer.restart();
+    for(int i = 0; i < packets.size(); i++)
+    {
+        if(i % PacketDecoder::batchSize == 0)
+            batches.append(QVector<canvas::DecodedPacket>());
+        
+        Serial::packet_view p;
+        p.data = packets[i].data();
+        p.length = packets[i].size();
+        batches.last().append(decoder.decode(p));
+    }
+    qint64 decodeMicros = timer.nsecsElapsed() / 1000;
+    
+    canvas batchedBoard;
+    batchedBoard.resize(1280, 800);
+    batchedBoard.show();
+    QApplication::processEvents();
+    
+    qint64 batchedMicros = 0, longestBatch = 0;
+    for(int i = 0; i < batches.size(); i++)
+    {
+        timer.restart();
+        batchedBoard.applyDecoded(batches[i]);
+        QApplication::processEvents();
+        qint64 micros = timer.nsecsElapsed() / 1000;
+        batchedMicros += micros;
+        longestBatch = qMax(longestBatch, micros);
+    }
+    batchedBoard.hide();
+    
+    QStringList fields;
+    fields << QString("\"workload\":\"burst\"");
+    fields << QString("\"packets\":%1").arg(packets.size());
+    fields << QString("\"batches\":%1").arg(batches.size());
+    fields << QString("\"inline_input_wait_max_us\":%1").arg(inlineMicros);
+    fields << QString("\"batched_decode_us\":%1").arg(decodeMicros);
+    fields << QString("\"batched_gui_us\":%1").arg(batchedMicros);
+    fields << QString("\"batched_input_wait_max_us\":%1").arg(longestBatch);
+    
+    std::cout << "{" << fields.join(",").toStdString() << "}" << std::endl;
+}
+
+void CanvasBenchmark::measureStall(bool paintLoad)
+{
+    // Strokes of 50 segments, each fitting in a packet, sent over and over:
+    QList<Serial::packet> packets;
+    canvas encoder;
+    encoder.toolType = "pen";
+    encoder.currentLines.color = Qt::black;
+    Strokes strokes = syntheticStrokes(50 * 100);
+    for(int i = 0; i < strokes.size(); i++)
+    {
+        encoder.currentLines.points = strokes[i];
+        packets += encoder.serialize();
+    }
+    
+    Serial::options opts;
+    opts.bitrate = 8000;
+    opts.edge_events = true;
+    
+    // The bus and the nodes are declared first, so that they outlive the canvas reading from them:
+    SimulatedBus bus;
+    Serial sender(bus.connect(), 0, 1, opts);
+    Serial receiver(bus.connect(), 0, 1, opts);
+    
+    canvas board;
+    board.setSerial(&receiver);
+    board.resize(1280, 800);
+    board.show();
+    QApplication::processEvents();
+    
+    QElapsedTimer timer;
+    QVector<qint64> frames;
+    int next = 0;
+    timer.start();
+    while(timer.elapsed() < 2000)
+    {
+        while(sender.remaining() < 2 && sender.write(packets[next]))
+            next = (next + 1) % packets.size();
+        
+        // Painting everything from scratch keeps the GUI thread busy, as a large canvas being redrawn does:
+        if(paintLoad)
+        {
+            QElapsedTimer frame;
+            frame.start();
+            board.committedLayer = QImage();
+            board.repaint();
+            frames.append(frame.nsecsElapsed() / 1000);
+        }
+        else
+            usleep(1000);
+        QApplication::processEvents();
+    }
+    board.hide();
+    std::sort(frames.begin(), frames.end());
+    
+    QStringList fields;
+    fields << QString("\"workload\":\"stall\"");
+    fields << QString("\"paint_load\":%1").arg(paintLoad ? "true" : "false");
+    fields << QString("\"bitrate\":%1").arg(opts.bitrate);
+    fields << QString("\"groups_received\":%1").arg(board.lines.size());
+    fields << QString("\"frames\":%1").arg(frames.size());
+    fields << QString("\"frame_p50_us\":%1").arg(percentile(frames, 50));
+    fields << QString("\"max_edge_latency_us\":%1").arg(qMax(sender.max_edge_latency(), receiver.max_edge_latency()));
+    
+    std::cout << "{" << fields.join(",").toStdString() << "}" << std::endl;
+}
+
+void CanvasBenchmark::measureFraming(bool extendedLength, int segments)
+{
+    const int strokeCount = 5;
+    
+    Serial::options opts;
+    opts.bitrate = 16000;
+    opts.edge_events = true;
+    opts.extended_length = extendedLength;
+    
+    SimulatedBus bus;
+    Serial sender(bus.connect(), 0, 1, opts);
+    Serial receiver(bus.connect(), 0, 1, opts);
+    
+    canvas encoder;
+    encoder.toolType = "pen";
+    encoder.currentLines.color = Qt::black;
+    encoder.setPacketLimit(sender.packet_limit());
+    canvas board;
+    
+    Strokes strokes = syntheticStrokes(segments * strokeCount, segments);
+    
+    // Each stroke is sent on its own, and timed from writing its first packet to reading its last one.
+    // The frames only add their length bytes, as the priority byte and the CRC are off by default:
+    int packetCount = 0;
+    qint64 payloadBytes = 0, wireBytes = 0, nanos = 0;
+    QElapsedTimer timer;
+    for(int i = 0; i < strokes.size(); i++)
+    {
+        encoder.currentLines.points = strokes[i];
+        QList<Serial::packet> packets = encoder.serialize();
+        
+        timer.start();
+        for(int j = 0; j < packets.size(); j++)
+        {
+            sender.write(packets[j]);
+            payloadBytes += packets[j].size();
+            wireBytes += (extendedLength ? 2 : 1) + packets[j].size();
+        }
+        for(int received = 0; received < packets.size(); )
+        {
+            Serial::packet_view p = receiver.peek_view();
+            if(p.empty())
+            {
+                usleep(100);
+                continue;
+            }
+            board.deserialize(p);
+            receiver.release();
+            received++;
+        }
+        nanos += timer.nsecsElapsed();
+        packetCount += packets.size();
+    }
+    
+    QStringList fields;
+    fields << QString("\"workload\":\"framing\"");
+    fields << QString("\"extended_length\":%1").arg(extendedLength ? "true" : "false");
+    fields << QString("\"packet_limit\":%1").arg(sender.packet_limit());
+    fields << QString("\"stroke_segments\":%1").arg(segments);
+    fields << QString("\"packets_per_stroke\":%1").arg((double) packetCount / strokes.size());
+    fields << QString("\"payload_bytes_per_stroke\":%1").arg((double) payloadBytes / strokes.size());
+    fields << QString("\"wire_bytes_per_stroke\":%1").arg((double) wireBytes / strokes.size());
+    fields << QString("\"ms_per_stroke\":%1").arg(nanos / 1e6 / strokes.size(), 0, 'f', 1);
+    fields << QString("\"groups_per_stroke\":%1").arg((double) board.lines.size() / strokes.size());
+    
+    std::cout << "{" << fields.join(",").toStdString() << "}" << std::endl;
+}
+
+void CanvasBenchmark::measureJournal(int segments)
+{
+    QTemporaryDir dir;
+    std::string path = dir.filePath("journal").toStdString();
+    
+    // The journal a board would have after drawing the strokes:
+    canvas encoder;
+    encoder.toolType = "pen";
+    encoder.currentLines.color = Qt::black;
+    Strokes strokes = syntheticStrokes(segments);
+    {
+        Journal journal(path);
+        for(int i = 0; i < strokes.size(); i++)
+        {
+            encoder.currentLines.points = strokes[i];
+            QList<Serial::packet> packets = encoder.serialize();
+            for(int j = 0; j < packets.size(); j++)
+                journal.append(packets[j].data(), packets[j].size());
+        }
+    }
+    qint64 fileBytes = QFileInfo(QString::fromStdString(path)).size();
+    
+    // Writes the file out and drops it from the page cache, so that it's read from the disk as after a reboot:
+    int fd = open(path.c_str(), O_RDONLY);
+    if(fd >= 0)
+    {
+        fdatasync(fd);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+    
+    // Opening the journal and rebuilding the board from it, as on startup, first from the disk and then cached:
+    QElapsedTimer timer;
+    qint64 coldMicros = 0, warmMicros = 0;
+    int records = 0, groups = 0;
+    for(int run = 0; run < 2; run++)
+    {
+        timer.start();
+        Journal journal(path);
+        canvas board;
+        board.setJournal(&journal);
+        qint64 micros = timer.nsecsElapsed() / 1000;
+        
+        (run == 0 ? coldMicros : warmMicros) = micros;
+        records = journal.size();
+        groups = board.lines.size();
+    }
+    
+    QStringList fields;
+    fields << QString("\"workload\":\"journal\"");
+    fields << QString("\"segments\":%1").arg(segments);
+    fields << QString("\"records\":%1").arg(records);
+    fields << QString("\"groups\":%1").arg(groups);
+    fields << QString("\"file_bytes\":%1").arg(fileBytes);
+    fields << QString("\"cold_start_ms\":%1").arg(coldMicros / 1000.0, 0, 'f', 1);
+    fields << QString("\"warm_start_ms\":%1").arg(warmMicros / 1000.0, 0, 'f', 1);
+    
+    std::cout << "{" << fields.join(",").toStdString() << "}" << std::endl;
+}
+
+void CanvasBenchmark::measureSync(int strokeCount)
+{
+    // A snapshot of thousands of strokes is hundreds of kilobytes, so it's sent over all eight data lines:
+    Serial::options opts;
+    opts.bitrate = 16000;
+    opts.edge_events = true;
+    for(int pin = 2; pin <= 8; pin++)
+        opts.extra_data_pins.push_back(pin);
+    
+    // The bus and the nodes are declared first, so that they outlive the canvases using them:
+    SimulatedBus bus;
+    Serial sourceSerial(bus.connect(), 0, 1, opts);
+    Serial joinerSerial(bus.connect(), 0, 1, opts);
+    
+    canvas source, joiner;
+    source.setSerial(&sourceSerial);
+    joiner.setSerial(&joinerSerial);
+    QObject::connect(&source, &canvas::sendPacket, &sourceSerial, &Serial::write_prioritized);
+    QObject::connect(&joiner, &canvas::sendPacket, &joinerSerial, &Serial::write_prioritized);
+    
+    Strokes strokes = syntheticStrokes(50 * strokeCount);
+    for(int i = 0; i < strokes.size(); i++)
+    {
+        canvas::LineGroup group;
+        group.color = Qt::black;
+        group.points = strokes[i];
+        group.updateBounds();
+        source.lines.append(group);
+    }
+    
+    // The snapshot the source board will send, split up as it is when answering:
+    int snapshotBytes = source.snapshot().size();
+    int chunkData = qMin<int>(source.packetLimit, Serial::max_packet_size) - canvas::syncHeaderSize;
+    int chunks = (snapshotBytes + chunkData - 1) / chunkData;
+    
+    // The request is answered after a random delay, and the chunks are sent one at a time from the source board's
+    // timer, so the events are processed until the snapshot's been restored (or given up on):
+    QElapsedTimer timer;
+    timer.start();
+    joiner.requestSync();
+    while(joiner.syncNonce != 0 && timer.elapsed() < 600000)
+    {
+        QApplication::processEvents();
+        usleep(1000);
+    }
+    qint64 syncMillis = timer.elapsed();
+    
+    QStringList fields;
+    fields << QString("\"workload\":\"sync\"");
+    fields << QString("\"strokes\":%1").arg(strokes.size());
+    fields << QString("\"bitrate\":%1").arg(opts.bitrate);
+    fields << QString("\"data_lines\":%1").arg(1 + opts.extra_data_pins.size());
+    fields << QString("\"snapshot_bytes\":%1").arg(snapshotBytes);
+    fields << QString("\"chunks\":%1").arg(chunks);
+    fields << QString("\"synced\":%1").arg(joiner.lines.size() == source.lines.size() ? "true" : "false");
+    fields << QString("\"sync_ms\":%1").arg(syncMillis);
+    
+    std::cout << "{" << fields.join(",").toStdString() << "}" << std::endl;
+}
@@ -0,0 +1,75 @@
+#ifndef CANVAS_BENCHMARK_H
+#define CANVAS_BENCHMARK_H
+
+#include <QString>
+#include <QVector>
+#include <QPoint>
+
+#include <functional>
+
+class canvas;
+
+// Measures the canvas' hot paths (encoding strokes into packets, decoding them and painting them) on workloads
+// from 10 to 100k segments, printing one JSON object per workload to the standard output. Run by the benchmark target,
+// which uses the offscreen platform so that it doesn't need a display.
+class CanvasBenchmark
+{
+public:
+    // Runs the synthetic workloads, and the strokes recorded in a journal file if a path is given.
+    // Returns the exit code for the benchmark.
+    static int run(const QString &journalPath);
+
+private:
+    typedef QVector<QVector<QPoint>> Strokes;
+    
+    static Strokes syntheticStrokes(int segments, int strokeSegments = 50); // random pen strokes with the given number of segments in all
+    static Strokes recordedStrokes(const QString &journalPath);             // the pen strokes in a journal file
+    static void measure(const QString &workload, const Strokes &strokes);   // runs the benchmark on some strokes and prints the results
+    
+    // Builds the given number of pen strokes as point arrays, and in the layout they used to have (a list of lines
+    // per group), and prints the heap bytes used by each and how long each takes to paint.
+    static void measureLayout(int strokeCount);
+    
+    // Feeds a pen stroke from a pointer reporting at 200 Hz through the canvas' input stage, one frame at a time,
+    // and prints the points kept, the points and bytes sent, and the frame times.
+    static void measureInput(const QString &workload, bool coalesce, double resampleStep, double smoothing);
+    
+    // Draws a pen stroke on a board as a pointer reporting every 5 ms would, adding the movements once per frame, and
+    // lifts the pen at the end. The events are processed, and the given function called, in between.
+    static void drawStroke(canvas &board, const QVector<QPoint> &stroke, const std::function<void()> &poll);
+    
+    // Draws pen strokes of a second on one board, sending them while they're drawn every given number of milliseconds
+    // (0 to only send them once they're finished), and prints how soon another board on the simulated bus shows the
+    // start of each stroke and, after the pen is lifted, the whole of it.
+    static void measureStreaming(int streamInterval);
+    
+    // Draws some pen strokes one after another on a board sending them while they're drawn, with the chunks waiting
+    // for the bus replaced by ones carrying on to the new points or not, and prints the bus time taken, the bytes
+    // saved, and how long the other board on the simulated bus takes to catch up once they've been drawn.
+    static void measureReplay(const QString &workload, const Strokes &strokes, bool replace);
+    
+    // Receives a burst of stroke packets from another board, decoded and painted inline on the GUI thread (as it used
+    // to be) and through the decoder in batches, and prints the longest the GUI thread is busy in each case, which is
+    // how long local input can be kept waiting.
+    static void measureBurst(int packetCount);
+    
+    // Streams stroke packets between two boards on the simulated bus, the receiving one handing them to a canvas,
+    // while the GUI thread idles or repaints the whole canvas over and over, and prints the worst delay seen between
+    // a pin edge and its handler on the pin thread.
+    static void measureStall(bool paintLoad);
+    
+    // Sends pen strokes of the given number of segments between two boards on the simulated bus, with one or two
+    // length bytes per frame, and prints the packets, bytes on the wire and time taken per stroke, and the groups
+    // they make on the receiving board.
+    static void measureFraming(bool extendedLength, int segments);
+    
+    // Has a board joining late sync the given number of pen strokes from another one over the simulated bus, from its
+    // request to the snapshot being restored, and prints the size of the snapshot, its chunks and the time taken.
+    static void measureSync(int strokeCount);
+    
+    // Writes the packets of the given number of segments to a journal, and prints its size and the time taken to open
+    // it and rebuild a canvas from it, with the file dropped from the page cache (as after a reboot) and cached.
+    static void measureJournal(int segments);
+};
+
+#endif // CANVAS_BENCHMARK_H
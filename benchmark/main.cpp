@@ -0,0 +1,44 @@
+#include "bus_benchmark.hpp"
+#include "canvas_benchmark.h"
+
+#include <QApplication>
+
+#include <iostream>
+#include <string>
+
+// Runs the benchmarks, printing one JSON object per workload to the standard output.
+// '--bus' and '--canvas' only run one of them, and '--journal FILE' adds the strokes recorded in a journal
+// to the canvas' workloads.
+int main(int argc, char *argv[])
+{
+    bool bus = true;
+    bool canvas = true;
+    std::string journal_path;
+    
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--bus")
+            canvas = false;
+        else if (arg == "--canvas")
+            bus = false;
+        else if (arg == "--journal" && i + 1 < argc)
+            journal_path = argv[++i];
+        else
+        {
+            std::cout << "Usage: " << argv[0] << " [--bus | --canvas] [--journal FILE]" << std::endl;
+            return 1;
+        }
+    }
+    
+    // The canvas is drawn without a display unless a Qt platform's been asked for:
+    if (qEnvironmentVariableIsEmpty("QT_QPA_PLATFORM"))
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+    QApplication a(argc, argv);
+    
+    if (bus)
+        BusBenchmark::run();
+    if (canvas)
+        return CanvasBenchmark::run(QString::fromStdString(journal_path));
+    return 0;
+}
@@ -0,0 +1,17 @@
+# The canvas and what it needs besides the bus, for the targets which run without a Raspberry Pi and draw
+# (off screen).
+include(headless.pri)
+
+HEADERS += \
+    $$PWD/src/canvas.h \
+    $$PWD/src/decoder.h \
+    $$PWD/src/journal.hpp \
+    $$PWD/src/tracer.hpp
+
+SOURCES += \
+    $$PWD/src/canvas.cpp \
+    $$PWD/src/decoder.cpp \
+    $$PWD/src/journal.cpp \
+    $$PWD/src/tracer.cpp
+
+QT += widgets
@@ -0,0 +1,18 @@
+# Sources shared by the targets which run without a Raspberry Pi (the benchmark and the tests):
+# the bus and the simulated bus it runs on, built without the wiringPi backend.
+INCLUDEPATH += $$PWD/src
+DEFINES += NO_WIRINGPI
+LIBS += -pthread
+
+HEADERS += \
+    $$PWD/src/serial.hpp \
+    $$PWD/src/simulated_bus.hpp \
+    $$PWD/src/pin_backend.hpp \
+    $$PWD/src/edge_source.hpp \
+    $$PWD/src/packet_ring.hpp \
+    $$PWD/src/histogram.hpp \
+    $$PWD/src/fnv1a.hpp
+
+SOURCES += \
+    $$PWD/src/serial.cpp \
+    $$PWD/src/simulated_bus.cpp
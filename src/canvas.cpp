@@ -1,57 +1,353 @@
 #include "canvas.h"
+#include "decoder.h"
 
-canvas::canvas(QWidget *parent) : QWidget(parent) { }
+#include <QGuiApplication>
+#include <QScreen>
 
-void canvas::mouseMoveEvent(QMouseEvent *event)
+#include <random>
+#include <cmath>
+
+// Appends a signed value as a zig-zag varint (7 bits per byte, LSB first, top bit set on all but the last byte),
+// so that small deltas in either direction take a single byte.
+static void pushVarint(Serial::packet &p, int value)
 {
-    QPoint point1, point2;
+    unsigned int zigzag = ((unsigned int) value << 1) ^ (unsigned int) (value >> 31);
+    while(zigzag >= 0x80)
+    {
+        p.push_back((zigzag & 0x7F) | 0x80);
+        zigzag >>= 7;
+    }
+    p.push_back(zigzag);
+}
 
-    if(toolType == "pen")
+// Reads a zig-zag varint starting at index i, moving i past it. Returns false if the packet ends first.
+static bool readVarint(const Serial::packet_view &p, unsigned int &i, int &value)
+{
+    unsigned int zigzag = 0;
+    for(int shift = 0; i < p.size() && shift < 32; shift += 7)
     {
-        if(currentLines.lines.isEmpty())
-            point1 = event->pos();
-        else
-            point1 = currentLines.lines.last().p2();
-        point2 = event->pos();
-        currentLines.lines.append(QLine(point1, point2));
-        update();
+        unsigned char byte = p[i++];
+        zigzag |= (unsigned int) (byte & 0x7F) << shift;
+        if(!(byte & 0x80))
+        {
+            value = (int) (zigzag >> 1) ^ -(int) (zigzag & 1);
+            return true;
+        }
     }
-    if(toolType == "line")
+    return false;
+}
+
+// Appends a point as absolute 16-bit coordinates.
+static void pushPoint(Serial::packet &p, const QPoint &point)
+{
+    p.push_back((point.x() >> 0) & 0xFF);
+    p.push_back((point.x() >> 8) & 0xFF);
+    p.push_back((point.y() >> 0) & 0xFF);
+    p.push_back((point.y() >> 8) & 0xFF);
+}
+
+// Squared distance from point p to the line segment from a to b.
+static double segmentDistanceSquared(const QPoint &p, const QPoint &a, const QPoint &b)
+{
+    double dx = b.x() - a.x();
+    double dy = b.y() - a.y();
+    double px = p.x() - a.x();
+    double py = p.y() - a.y();
+    double lengthSquared = dx * dx + dy * dy;
+    
+    double t = lengthSquared > 0 ? (px * dx + py * dy) / lengthSquared : 0;
+    t = qBound(0.0, t, 1.0);
+    
+    double ex = px - t * dx;
+    double ey = py - t * dy;
+    return ex * ex + ey * ey;
+}
+
+// Ramer-Douglas-Peucker: marks the points to keep so that no dropped point is further than the tolerance
+// from the simplified line. Uses a stack of ranges rather than recursion, since strokes can be long.
+static QVector<QPoint> simplifyPolyline(const QVector<QPoint> &points, double tolerance)
+{
+    if(points.size() < 3)
+        return points;
+    
+    QVector<bool> keep(points.size(), false);
+    keep.first() = true;
+    keep.last() = true;
+    
+    QVector<QPair<int, int>> ranges;
+    ranges.append(qMakePair(0, points.size() - 1));
+    while(!ranges.isEmpty())
     {
-        if(currentLines.lines.isEmpty())
+        QPair<int, int> range = ranges.takeLast();
+        
+        // Find the point furthest from the line between the ends of the range:
+        int furthest = -1;
+        double furthestDistance = tolerance * tolerance;
+        for(int i = range.first + 1; i < range.second; i++)
         {
-           currentLines.lines.append(QLine());
-           point1 = event->pos();
+            double distance = segmentDistanceSquared(points[i], points[range.first], points[range.second]);
+            if(distance > furthestDistance)
+            {
+                furthest = i;
+                furthestDistance = distance;
+            }
         }
-        else
+        
+        // If it's out of tolerance, keep it and simplify either side of it:
+        if(furthest >= 0)
         {
-            point1 = currentLines.lines.last().p1();
+            keep[furthest] = true;
+            ranges.append(qMakePair(range.first, furthest));
+            ranges.append(qMakePair(furthest, range.second));
         }
-        point2 = event->pos();
-        currentLines.lines.replace(0, QLine(point1, point2));
-        update();
     }
-    if(toolType == "rectangle")
+    
+    QVector<QPoint> simplified;
+    for(int i = 0; i < points.size(); i++)
+        if(keep[i])
+            simplified.append(points[i]);
+    return simplified;
+}
+
+// Area that needs repainting for lines within the bounding box, allowing for the width of the pen.
+static QRect repaintArea(const QRect &bounds)
+{
+    const int margin = 2;
+    return bounds.adjusted(-margin, -margin, margin, margin);
+}
+
+void canvas::LineGroup::updateBounds()
+{
+    if(points.isEmpty())
+    {
+        bounds = QRect();
+        return;
+    }
+    
+    int left = points[0].x(), right = left;
+    int top = points[0].y(), bottom = top;
+    for(int i = 1; i < points.size(); i++)
+    {
+        left = qMin(left, points[i].x());
+        right = qMax(right, points[i].x());
+        top = qMin(top, points[i].y());
+        bottom = qMax(bottom, points[i].y());
+    }
+    bounds = QRect(QPoint(left, top), QPoint(right, bottom));
+}
+
+canvas::canvas(QWidget *parent) : QWidget(parent)
+{
+    // Stroke ids start from a random value, so that ids from different boards are unlikely to clash:
+    std::random_device random;
+    nextStrokeId = (random() & 0xFFFF) << 16;
+    boardId = random() & 0xFFFF;
+    
+    connect(&syncTimer, &QTimer::timeout, this, &canvas::sendSyncChunk);
+    connect(&statisticsTimer, &QTimer::timeout, this, &canvas::refreshStatistics);
+    
+    // Pointer movements are added to the drawing at the display's refresh rate:
+    QScreen *screen = QGuiApplication::primaryScreen();
+    double refreshRate = screen && screen->refreshRate() > 0 ? screen->refreshRate() : 60;
+    inputTimer.setSingleShot(true);
+    inputTimer.setTimerType(Qt::PreciseTimer);
+    inputTimer.setInterval(qMax(1, qRound(1000 / refreshRate)));
+    connect(&inputTimer, &QTimer::timeout, this, &canvas::processInput);
+}
+
+canvas::~canvas()
+{
+    decoderThread.quit();
+    decoderThread.wait();
+}
+
+void canvas::setSerial(Serial *serial)
+{
+    this->serial = serial;
+    
+    // The received packets are decoded on a thread of their own, and handed back in batches:
+    qRegisterMetaType<QVector<DecodedPacket>>();
+    decoder = new PacketDecoder();
+    decoder->setKeepDrawingBytes(journal);
+    decoder->setTraceIds(tracer);
+    decoder->moveToThread(&decoderThread);
+    connect(&decoderThread, &QThread::finished, decoder, &QObject::deleteLater);
+    connect(serial, &Serial::packet_received, decoder, &PacketDecoder::decodePackets);
+    connect(decoder, &PacketDecoder::decoded, this, &canvas::applyDecoded);
+    decoderThread.start();
+}
+
+void canvas::setTracer(Tracer *tracer, int node)
+{
+    this->tracer = tracer;
+    traceNode = node;
+    if(decoder)
+        decoder->setTraceIds(tracer);
+}
+
+void canvas::setJournal(Journal *journal)
+{
+    // The packets are decoded straight out of the journal's mapping:
+    journal->replay([this] (const Serial::packet_view &p) {
+        deserialize(p);
+    });
+    this->journal = journal;
+    if(decoder)
+        decoder->setKeepDrawingBytes(journal);
+}
+
+void canvas::setPacketLimit(std::size_t limit)
+{
+    packetLimit = limit;
+}
+
+void canvas::setStreaming(int intervalMillis)
+{
+    streamInterval = intervalMillis;
+}
+
+void canvas::setSimplification(double tolerance, int minDistance)
+{
+    simplifyTolerance = tolerance;
+    minPointDistance = minDistance;
+}
+
+void canvas::setInputFiltering(double resampleStep, double smoothing)
+{
+    this->resampleStep = resampleStep;
+    this->smoothing = qBound(0.0, smoothing, 0.99);
+}
+
+void canvas::mouseMoveEvent(QMouseEvent *event)
+{
+    if(tracer && unsentMove == std::chrono::steady_clock::time_point())
+        unsentMove = std::chrono::steady_clock::now();
+    
+    // Tablets and touch panels can report movements several times per frame, so they're collected
+    // and added to the drawing with a single repaint per frame:
+    pendingInput.append(event->pos());
+    lastInput = event->pos();
+    inputEvents++;
+    if(!inputTimer.isActive())
+        inputTimer.start();
+}
+
+void canvas::processInput()
+{
+    inputTimer.stop();
+    if(pendingInput.isEmpty())
+        return;
+    inputFrames++;
+    
+    QVector<QPoint> input;
+    input.swap(pendingInput);
+    QPoint latest = input.last();
+    QPoint point1, point2;
+    
+    if(toolType == "pen")
     {
-        if(currentLines.lines.isEmpty())
+        currentLines.shape = LineGroup::Polyline;
+        QVector<QPoint> &points = currentLines.points;
+        if(points.isEmpty())
         {
-            for(int i = 0; i < 4; i++)
-                currentLines.lines.append(QLine());
-            point1 = event->pos();
+            points.append(input.first());
+            smoothedInput = resampledInput = input.first();
+            inputPoints++;
         }
-        else
+        int added = points.size();
+        
+        for(int i = 0; i < input.size(); i++)
         {
-            point1 = currentLines.lines.first().p1();
+            QPointF target = input[i];
+            if(smoothing > 0)
+            {
+                smoothedInput = smoothedInput * smoothing + target * (1 - smoothing);
+                target = smoothedInput;
+            }
+            
+            if(resampleStep <= 0)
+            {
+                if(target.toPoint() != points.last())
+                    points.append(target.toPoint());
+                continue;
+            }
+            
+            // Keep the position once it's a step away from the last point kept:
+            QPointF offset = target - resampledInput;
+            if(std::hypot(offset.x(), offset.y()) < resampleStep)
+                continue;
+            resampledInput = target;
+            points.append(target.toPoint());
         }
-        point2 = event->pos();
-        QList<QLine> newLines;
-        newLines.append(QLine(point1.x(), point1.y(), point1.x(), point2.y()));
-        newLines.append(QLine(point1.x(), point2.y(), point2.x(), point2.y()));
-        newLines.append(QLine(point2.x(), point2.y(), point2.x(), point1.y()));
-        newLines.append(QLine(point2.x(), point1.y(), point1.x(), point1.y()));
-        for(int i = 0; i < 4; i++)
-            currentLines.lines.replace(i, newLines[i]);
-        update();
+        inputPoints += points.size() - added;
+        
+        // Repaint the new segments:
+        QRect segmentBounds;
+        for(int i = qMax(added, 1); i < points.size(); i++)
+            segmentBounds |= QRect(points[i - 1], points[i]).normalized();
+        if(segmentBounds.isNull())
+            return;
+        currentLines.bounds |= segmentBounds;
+        update(repaintArea(segmentBounds));
+        
+        // Send what's been drawn so far every so often, or once there's enough to fill a packet:
+        if(streamInterval > 0)
+        {
+            if(!streamTimer.isValid())
+                streamTimer.start();
+            
+            const int chunkPoints = (packetLimit - strokeHeaderSize) / 6;
+            if(streamTimer.elapsed() >= streamInterval || currentLines.points.size() - streamedPoints >= chunkPoints)
+            {
+                flushStroke(false);
+            }
+        }
+    }
+    if(toolType == "line")
+    {
+        currentLines.shape = LineGroup::Line;
+        if(currentLines.points.isEmpty())
+            currentLines.points.append(input.first());
+        point1 = currentLines.points.first();
+        point2 = latest;
+        currentLines.points.resize(2);
+        currentLines.points[1] = point2;
+        
+        // Repaint where the line was as well as where it is now:
+        QRect oldBounds = currentLines.bounds;
+        currentLines.updateBounds();
+        update(repaintArea(oldBounds | currentLines.bounds));
+    }
+    if(toolType == "rectangle")
+    {
+        // Stored as the corner the rectangle was started from and the opposite corner:
+        currentLines.shape = LineGroup::Rectangle;
+        if(currentLines.points.isEmpty())
+            currentLines.points.append(input.first());
+        point1 = currentLines.points.first();
+        point2 = latest;
+        currentLines.points.resize(2);
+        currentLines.points[1] = point2;
+        
+        QRect oldBounds = currentLines.bounds;
+        currentLines.updateBounds();
+        update(repaintArea(oldBounds | currentLines.bounds));
+    }
+}
+
+void canvas::finishInput()
+{
+    processInput();
+    
+    // The stroke ends where the pointer was released, even if that's less than a step from the last point kept:
+    QVector<QPoint> &points = currentLines.points;
+    if(toolType == "pen" && !points.isEmpty() && points.last() != lastInput)
+    {
+        QRect segmentBounds = QRect(points.last(), lastInput).normalized();
+        points.append(lastInput);
+        inputPoints++;
+        currentLines.bounds |= segmentBounds;
+        update(repaintArea(segmentBounds));
     }
 }
 
@@ -59,60 +355,561 @@ void canvas::mousePressEvent(QMouseEvent *event)
 {
     if (toolType == "clear")
     {
-        lines.clear();
+        clearLines();
         update();
     }
 }
 
 void canvas::mouseReleaseEvent(QMouseEvent *event)
 {
-    QList<Serial::packet> packets = serialize();
+    finishInput();
     
-    for(int i = 0; i < packets.size(); i++)
-        emit sendPacket(packets[i]);
+    // The stroke may shrink when it's simplified, but it has to be repainted where it was drawn:
+    QRect drawnBounds = currentLines.bounds;
     
-    lines.append(currentLines);
-    currentLines.lines.clear();
+    if(toolType == "pen" && streamInterval > 0)
+    {
+        // Send the rest of the stroke, telling the receivers it's finished:
+        flushStroke(true);
+    }
+    else
+    {
+        if(toolType == "pen")
+            currentLines.points = simplifyStroke(currentLines.points);
+        QList<Serial::packet> packets = serialize();
+        
+        // Nothing drawn before a clear needs to be sent any more:
+        if(toolType == "clear")
+            emit cancelPackets();
+        
+        sendPackets(packets);
+    }
+    
+    // A click without any movement (or a clear) leaves nothing to keep:
+    currentLines.updateBounds();
+    if(!currentLines.points.isEmpty())
+        lines.append(currentLines);
+    update(repaintArea(drawnBounds | currentLines.bounds));
+    currentLines.points.clear();
+    currentLines.bounds = QRect();
+    streamedPoints = 0;
+    queuedChunkFrom = -1;
+    streamTimer.invalidate();
 }
 
-void canvas::paintEvent(QPaintEvent*)
+void canvas::paintEvent(QPaintEvent *event)
 {
+    QElapsedTimer paintTimer;
+    paintTimer.start();
+    
+    // Rasterize the committed groups into the cached layer, starting again from scratch if the
+    // layer was invalidated or the widget was resized, and otherwise only adding the new groups:
+    if(committedLayer.size() != size())
+    {
+        committedLayer = QImage(size(), QImage::Format_ARGB32_Premultiplied);
+        committedLayer.fill(Qt::transparent);
+        committedCount = 0;
+    }
+    if(committedCount < lines.size())
+    {
+        QPainter layerPainter(&committedLayer);
+        for(; committedCount < lines.size(); committedCount++)
+            drawGroup(layerPainter, lines[committedCount]);
+    }
+    
+    // Only the area that changed needs to be drawn:
+    QRect area = event->rect();
+    
     QPainter painter;
     painter.begin(this);
+    painter.drawImage(area, committedLayer, area);
+    if(repaintArea(currentLines.bounds).intersects(area))
+        drawGroup(painter, currentLines);
+    
+    // The overlay's only drawn when its area is being repainted, so it doesn't slow down drawing elsewhere:
+    if(statisticsVisible && statisticsArea.intersects(area))
+    {
+        painter.fillRect(statisticsArea, QColor(255, 255, 255, 200));
+        painter.setPen(Qt::black);
+        painter.drawText(statisticsArea.adjusted(4, 4, -4, -4), Qt::AlignLeft | Qt::AlignTop, statisticsCache);
+    }
+    painter.end();
+    
+    paintTime.add(paintTimer.nsecsElapsed() / 1000);
+    
+    if(tracer)
+    {
+        for(int i = 0; i < unpaintedPackets.size(); i++)
+            tracer->trace(traceNode, "paint", unpaintedPackets[i]);
+        unpaintedPackets.clear();
+    }
+}
+
+void canvas::drawGroup(QPainter &painter, const LineGroup &group)
+{
     QPen pen;
-    for(int i = 0; i < lines.size(); i++)
+    pen.setColor(group.color);
+    painter.setPen(pen);
+    
+    if(group.shape == LineGroup::Polyline)
+    {
+        painter.drawPolyline(group.points.constData(), group.points.size());
+    }
+    else if(group.points.size() == 2)
     {
-        pen.setColor(lines[i].color);
-        painter.setPen(pen);
-        for(int j = 0; j < lines[i].lines.size(); j++)
+        if(group.shape == LineGroup::Line)
         {
-            painter.drawLine(lines[i].lines[j]);
+            painter.drawLine(group.points[0], group.points[1]);
+        }
+        else if(group.shape == LineGroup::Rectangle)
+        {
+            // The outline goes through both corners:
+            QRect rect = QRect(group.points[0], group.points[1]).normalized();
+            painter.drawRect(rect.x(), rect.y(), rect.width() - 1, rect.height() - 1);
         }
     }
+}
+
+void canvas::clearLines()
+{
+    lines.clear();
+    openStrokes.clear();
+    committedLayer = QImage();
     
-    pen.setColor(currentLines.color);
-    painter.setPen(pen);
-    for(int i = 0; i < currentLines.lines.size(); i++)
+    // Snapshots of what was there before are no longer needed:
+    syncNonce = 0;
+    syncData.clear();
+    syncReplyNonce = 0;
+    syncOutgoing.clear();
+    syncTimer.stop();
+}
+
+void canvas::requestSync()
+{
+    // Command 6: a random id for the request, which the snapshot chunks sent in reply carry:
+    std::random_device random;
+    syncNonce = random() | 1;
+    syncSource = -1;
+    syncNextChunk = 0;
+    syncData.clear();
+    
+    Serial::packet p;
+    p.push_back(6);
+    for(int b = 0; b < 4; b++)
+        p.push_back((syncNonce >> (8 * b)) & 0xFF);
+    emit sendPacket(p, Serial::priority_normal);
+}
+
+void canvas::answerSync()
+{
+    // Another board may have started answering while this one was waiting:
+    if(syncReplyNonce == 0)
+        return;
+    
+    // Command 7: the request id, this board's id, the index of the chunk and the number of chunks,
+    // followed by a piece of the compressed snapshot. The chunks fit in a packet without extended lengths,
+    // as the board joining may not have them:
+    QByteArray data = snapshot();
+    const int chunkData = qMin<int>(packetLimit, Serial::max_packet_size) - syncHeaderSize;
+    const int chunkCount = (data.size() + chunkData - 1) / chunkData;
+    if(chunkCount > 0xFFFF)
     {
-        painter.drawLine(currentLines.lines[i]);
+        // Too big to send, so another board's answer (or a later request) isn't held up waiting for this one:
+        syncReplyNonce = 0;
+        return;
     }
-    painter.end();
+    
+    syncOutgoing.clear();
+    for(int chunk = 0; chunk < chunkCount; chunk++)
+    {
+        Serial::packet p;
+        p.push_back(7);
+        for(int b = 0; b < 4; b++)
+            p.push_back((syncReplyNonce >> (8 * b)) & 0xFF);
+        p.push_back(boardId & 0xFF);
+        p.push_back(boardId >> 8);
+        p.push_back(chunk & 0xFF);
+        p.push_back(chunk >> 8);
+        p.push_back(chunkCount & 0xFF);
+        p.push_back(chunkCount >> 8);
+        
+        const char *piece = data.constData() + chunk * chunkData;
+        p.insert(p.end(), piece, piece + qMin(chunkData, data.size() - chunk * chunkData));
+        syncOutgoing.append(p);
+    }
+    
+    sendSyncChunk();
+    syncTimer.start(10);
+}
+
+void canvas::sendSyncChunk()
+{
+    // The snapshot only goes out while nothing else is waiting to be sent, so that it doesn't hold up
+    // anything being drawn. Only one chunk is queued at a time, so new strokes never wait for more than one:
+    if(serial && serial->remaining() > 0)
+        return;
+    
+    if(syncOutgoing.isEmpty())
+    {
+        syncReplyNonce = 0;
+        syncTimer.stop();
+        return;
+    }
+    emit sendPacket(syncOutgoing.takeFirst(), Serial::priority_bulk);
+}
+
+QByteArray canvas::snapshot()
+{
+    // Each group is its shape, colour and number of points, then its first point and the delta to each following point:
+    Serial::packet raw;
+    for(int g = 0; g < lines.size(); g++)
+    {
+        const LineGroup &group = lines[g];
+        if(group.points.isEmpty())
+            continue;
+        
+        raw.push_back(group.shape);
+        raw.push_back(group.color.red()   & 0xFF);
+        raw.push_back(group.color.green() & 0xFF);
+        raw.push_back(group.color.blue()  & 0xFF);
+        pushVarint(raw, group.points.size());
+        
+        QPoint lastPoint;
+        for(int i = 0; i < group.points.size(); i++)
+        {
+            pushVarint(raw, group.points[i].x() - lastPoint.x());
+            pushVarint(raw, group.points[i].y() - lastPoint.y());
+            lastPoint = group.points[i];
+        }
+    }
+    
+    // Strokes have lots in common (colours, similar deltas), so the snapshot compresses well:
+    return qCompress(raw.data(), raw.size());
+}
+
+void canvas::restoreSnapshot(const QByteArray &compressed)
+{
+    QByteArray raw = qUncompress(compressed);
+    
+    Serial::packet_view p;
+    p.data = (const unsigned char *) raw.constData();
+    p.length = raw.size();
+    
+    QVector<LineGroup> restored;
+    for(unsigned int i = 0; i + 4 <= p.size(); )
+    {
+        LineGroup group;
+        int shape = p[i];
+        if(shape > LineGroup::Rectangle)
+            break;
+        group.shape = (LineGroup::Shape) shape;
+        group.color = QColor(p[i + 1], p[i + 2], p[i + 3]);
+        i += 4;
+        
+        int count;
+        if(!readVarint(p, i, count) || count <= 0)
+            break;
+        
+        int x = 0, y = 0, dx, dy;
+        group.points.reserve(qMin<unsigned int>(count, p.size() - i));
+        for(int n = 0; n < count && readVarint(p, i, dx) && readVarint(p, i, dy); n++)
+        {
+            x = (int16_t) (x + dx);
+            y = (int16_t) (y + dy);
+            group.points.append(QPoint(x, y));
+        }
+        if(group.points.size() != count)
+            break;
+        
+        group.updateBounds();
+        restored.append(group);
+    }
+    
+    // The snapshot comes before anything received while it was on its way, and everything has to be redrawn:
+    for(QHash<quint32, int>::iterator it = openStrokes.begin(); it != openStrokes.end(); ++it)
+        it.value() += restored.size();
+    lines = restored + lines;
+    committedLayer = QImage();
+    update();
+}
+
+void canvas::sendPackets(const QList<Serial::packet> &packets, quint32 key)
+{
+    for(int i = 0; i < packets.size(); i++)
+    {
+        record(packets[i]);
+        traceSerialized(packets[i]);
+        
+        // What's drawn goes ahead of snapshots and other bulk traffic when boards start sending at once:
+        emit sendPacket(packets[i], Serial::priority_interactive, key);
+    }
+    unsentMove = std::chrono::steady_clock::time_point();
+}
+
+void canvas::traceSerialized(const Serial::packet &p)
+{
+    if(!tracer)
+        return;
+    
+    // The movement that led to the packet is traced as well, at the time it happened:
+    quint32 id = Tracer::packet_id(p.data(), p.size());
+    if(unsentMove != std::chrono::steady_clock::time_point())
+        tracer->trace(traceNode, "mouse move", id, unsentMove);
+    tracer->trace(traceNode, "serialize", id);
+}
+
+void canvas::record(const Serial::packet &p)
+{
+    Serial::packet_view view;
+    view.data = p.data();
+    view.length = p.size();
+    record(view);
+}
+
+void canvas::record(const Serial::packet_view &p)
+{
+    if(!journal || p.empty())
+        return;
+    
+    // Nothing from before a clear is needed, so a clear empties the journal rather than being added to it.
+    // Sync requests and snapshot chunks aren't recorded (a snapshot is recorded once it's complete):
+    if(p[0] == 0)
+        journal->clear();
+    else if(p[0] != 6 && p[0] != 7)
+        journal->append(p.data, p.size());
 }
 
 void canvas::selectTool(QAction* tool)
 {
+    // Toggled options (like the statistics overlay) aren't tools:
+    if(tool->isCheckable())
+        return;
+    
     toolType = tool->text();
 }
 
+void canvas::showStatistics(bool show)
+{
+    statisticsVisible = show;
+    if(show)
+    {
+        refreshStatistics();
+        statisticsTimer.start(500);
+    }
+    else
+    {
+        statisticsTimer.stop();
+        update(statisticsArea);
+    }
+}
+
+void canvas::refreshStatistics()
+{
+    statisticsCache = statisticsText();
+    
+    // Repaint where the overlay was as well as where it is now, as it changes size with the text:
+    QRect oldArea = statisticsArea;
+    QRect textArea = fontMetrics().boundingRect(QRect(8, 8, 0, 0), Qt::AlignLeft | Qt::AlignTop | Qt::TextDontClip, statisticsCache);
+    statisticsArea = textArea.adjusted(-4, -4, 4, 4);
+    update(oldArea | statisticsArea);
+}
+
+QString canvas::statisticsText()
+{
+    int pointCount = 0;
+    for(int i = 0; i < lines.size(); i++)
+        pointCount += lines[i].points.size();
+    
+    QStringList text;
+    text << QString("groups: %1 (%2 points)").arg(lines.size()).arg(pointCount);
+    text << QString("input: %1 movements, %2 points kept, over %3 frames").arg(inputEvents).arg(inputPoints).arg(inputFrames);
+    text << QString("paint: mean %1 us, 99% under %2 us, max %3 us")
+            .arg(paintTime.mean(), 0, 'f', 0).arg(paintTime.percentile(99)).arg(paintTime.max);
+    
+    if(serial)
+    {
+        Serial::stats stats = serial->statistics();
+        text << QString("bus: %1 bit/s (bitrate %2)").arg(stats.bits_per_second, 0, 'f', 0).arg(serial->bitrate());
+        text << QString("frames: %1 sent, %2 received, %3 dropped, %4 resent")
+                .arg(stats.frames_sent).arg(stats.frames_received).arg(stats.frames_dropped).arg(stats.retransmissions);
+        text << QString("arbitration lost: %1").arg(stats.arbitration_lost);
+        text << QString("queues: %1 to send (at most %2), %3 received")
+                .arg(stats.tx_depth).arg(stats.tx_depth_max).arg(stats.rx_depth);
+        text << QString("queueing delay: mean %1 ms, 99% under %2 ms, max %3 ms")
+                .arg(stats.queue_delay.mean() / 1000, 0, 'f', 1)
+                .arg(stats.queue_delay.percentile(99) / 1000.0, 0, 'f', 1)
+                .arg(stats.queue_delay.max / 1000.0, 0, 'f', 1);
+        if(serial->edge_events())
+            text << QString("edge latency: max %1 us").arg(stats.max_edge_latency);
+    }
+    return text.join("\n");
+}
+
 void canvas::selectColor(QAction* color)
 {
     currentLines.color.setNamedColor(color->text());
 }
 
-void canvas::packetReceived(Serial* serial)
+void canvas::applyDecoded(const QVector<DecodedPacket> &batch)
+{
+    // Add the whole batch before repainting, so that a burst of packets only needs a few repaints:
+    QRect changed;
+    for(int i = 0; i < batch.size(); i++)
+    {
+        const DecodedPacket &decoded = batch[i];
+        if(tracer)
+            tracer->trace(traceNode, "packet received", decoded.traceId, decoded.received);
+        
+        // Drawing elements only come with their bytes when there's a journal to record them in:
+        record(decoded.bytes);
+        if(decoded.drawing)
+        {
+            changed |= merge(decoded);
+        }
+        else
+        {
+            Serial::packet_view p;
+            p.data = decoded.bytes.data();
+            p.length = decoded.bytes.size();
+            deserialize(p);
+        }
+        
+        if(tracer)
+        {
+            tracer->trace(traceNode, "deserialize", decoded.traceId);
+            unpaintedPackets.append(decoded.traceId);
+        }
+    }
+    
+    if(!changed.isNull())
+        update(repaintArea(changed));
+}
+
+QVector<QPoint> canvas::simplifyStroke(const QVector<QPoint> &stroke)
+{
+    if(stroke.isEmpty())
+        return stroke;
+    
+    // Drop points too close to the last point kept (but always keep the end of the stroke). The end is added
+    // rather than replacing the last point kept, so that every dropped point stays within minDistance of a point
+    // that's kept:
+    QVector<QPoint> points;
+    points.reserve(stroke.size());
+    points.append(stroke.first());
+    for(int i = 1; i < stroke.size(); i++)
+    {
+        QPoint offset = stroke[i] - points.last();
+        bool last = i == stroke.size() - 1;
+        
+        if(offset.x() * offset.x() + offset.y() * offset.y() >= minPointDistance * minPointDistance || last)
+            points.append(stroke[i]);
+    }
+    
+    if(simplifyTolerance > 0)
+        points = simplifyPolyline(points, simplifyTolerance);
+    
+    return points;
+}
+
+void canvas::flushStroke(bool last)
+{
+    QVector<QPoint> &points = currentLines.points;
+    if(points.isEmpty())
+        return;
+    
+    // Each chunk starts from the last point already sent, so that it joins on to the previous one:
+    int from = qMax(streamedPoints - 1, 0);
+    
+    // Nothing new to send, unless the receivers need to be told that the stroke is finished:
+    if(points.size() - from < 2 && !last)
+        return;
+    
+    if(streamedPoints == 0)
+        strokeId = nextStrokeId++;
+    
+    // Simplify the part that hasn't been sent yet, repainting where it was drawn before:
+    QVector<QPoint> unsent = points.mid(from);
+    LineGroup drawn;
+    drawn.points = unsent;
+    drawn.updateBounds();
+    
+    points.resize(from);
+    points += simplifyStroke(unsent);
+    update(repaintArea(drawn.bounds));
+    
+    QList<Serial::packet> packets = serializeStroke(from, last);
+    streamedPoints = points.size();
+    streamTimer.restart();
+    
+    // While the last chunk is still waiting for the bus, it's replaced by one carrying on to the new points
+    // (if they fit in the same packet) rather than another chunk with a header of its own being queued.
+    // The journal only gets the new chunk, as it already has the one that was replaced:
+    if(queuedChunkFrom >= 0 && serial)
+    {
+        QList<Serial::packet> merged = serializeStroke(queuedChunkFrom, last);
+        if(merged.size() == 1 && serial->replace(merged.first(), queuedChunkKey, Serial::priority_interactive))
+        {
+            for(int i = 0; i < packets.size(); i++)
+                record(packets[i]);
+            traceSerialized(merged.first());
+            unsentMove = std::chrono::steady_clock::time_point();
+            return;
+        }
+    }
+    
+    // Only a chunk which fits in one packet can be carried on like that, so only that's sent with a key:
+    queuedChunkFrom = -1;
+    queuedChunkKey = 0;
+    if(packets.size() == 1)
+    {
+        queuedChunkFrom = from;
+        queuedChunkKey = nextChunkKey++;
+        if(nextChunkKey == 0)
+            nextChunkKey = 1;
+    }
+    sendPackets(packets, queuedChunkKey);
+}
+
+QList<Serial::packet> canvas::serializeStroke(int from, bool last)
 {
-    while(serial->available())
-        deserialize(serial->read());
+    // Command 3: flags, stroke id, colour and an absolute start point, followed by the delta to each following point
+    // (the same as command 2). The first bit of the flags is set on the last chunk of the stroke.
+    QList<Serial::packet> packets;
+    const QVector<QPoint> &points = currentLines.points;
+    Serial::packet p;
+    QPoint lastPoint;
+    
+    for(int i = from; i < points.size(); i++)
+    {
+        // Start a new packet for the first point, or when the next delta might not fit:
+        if(i == from || p.size() + 6 > packetLimit)
+        {
+            if(i > from)
+                packets.append(p);
+            p = Serial::packet(0);
+            
+            p.push_back(3);
+            p.push_back(0);
+            for(int b = 0; b < 4; b++)
+                p.push_back((strokeId >> (8 * b)) & 0xFF);
+            p.push_back(currentLines.color.red()   & 0xFF);
+            p.push_back(currentLines.color.green() & 0xFF);
+            p.push_back(currentLines.color.blue()  & 0xFF);
+            
+            lastPoint = points[i == from ? i : i - 1];
+            pushPoint(p, lastPoint);
+            if(i == from)
+                continue;
+        }
+        pushVarint(p, points[i].x() - lastPoint.x());
+        pushVarint(p, points[i].y() - lastPoint.y());
+        lastPoint = points[i];
+    }
+    packets.append(p);
+    
+    if(last)
+        packets.last()[1] |= 1;
+    return packets;
 }
 
 QList<Serial::packet> canvas::serialize()
@@ -126,68 +923,284 @@ QList<Serial::packet> canvas::serialize()
         p.push_back(0);
         packets.append(p);
     }
-    else if (toolType == "pen" ||
-             toolType == "line" ||
+    else if (toolType == "line" ||
              toolType == "rectangle")
     {
-        for(int i = 0; i < currentLines.lines.size(); i++){
-
-            if(p.size() % 256 == 0 )
+        // Command 4 (line) or 5 (rectangle): the colour and the first point, followed by the delta to
+        // the second point (the same as a two-point stroke).
+        if(currentLines.points.size() == 2)
+        {
+            p.push_back(toolType == "line" ? 4 : 5);
+            p.push_back(currentLines.color.red()   & 0xFF);
+            p.push_back(currentLines.color.green() & 0xFF);
+            p.push_back(currentLines.color.blue()  & 0xFF);
+            pushPoint(p, currentLines.points[0]);
+            pushVarint(p, currentLines.points[1].x() - currentLines.points[0].x());
+            pushVarint(p, currentLines.points[1].y() - currentLines.points[0].y());
+            packets.append(p);
+        }
+    }
+    else if (toolType == "pen")
+    {
+        // Command 2: the colour and an absolute start point, followed by the delta to each following point.
+        // A stroke that doesn't fit in one packet carries on in the next, starting from the last point sent.
+        int lastX = 0, lastY = 0;
+        for(int i = 1; i < currentLines.points.size(); i++)
+        {
+            // Each delta takes at most 3 bytes for each of x and y:
+            if(p.empty() || p.size() + 6 > packetLimit)
             {
                 packets.append(p);
                 p = Serial::packet(0);
                 
-                p.push_back(1);
+                p.push_back(2);
                 p.push_back(currentLines.color.red()   & 0xFF);
                 p.push_back(currentLines.color.green() & 0xFF);
                 p.push_back(currentLines.color.blue()  & 0xFF);
-
-                x = currentLines.lines[i].x1();
-                y = currentLines.lines[i].y1();
+                
+                x = currentLines.points[i - 1].x();
+                y = currentLines.points[i - 1].y();
                 p.push_back((x >> 0) & 0xFF);
                 p.push_back((x >> 8) & 0xFF);
                 p.push_back((y >> 0) & 0xFF);
                 p.push_back((y >> 8) & 0xFF);
+                lastX = x;
+                lastY = y;
             }
-            int x = currentLines.lines[i].x2();
-            int y = currentLines.lines[i].y2();
-            p.push_back((x >> 0) & 0xFF);
-            p.push_back((x >> 8) & 0xFF);
-            p.push_back((y >> 0) & 0xFF);
-            p.push_back((y >> 8) & 0xFF);
+            x = currentLines.points[i].x();
+            y = currentLines.points[i].y();
+            pushVarint(p, x - lastX);
+            pushVarint(p, y - lastY);
+            lastX = x;
+            lastY = y;
         }
         packets.append(p);
         packets.erase(packets.begin());
+        
+        // A stroke too long for one packet is sent as chunks of a single stroke instead,
+        // so that the receivers put it back together as one group:
+        if(packets.size() > 1)
+        {
+            strokeId = nextStrokeId++;
+            packets = serializeStroke(0, true);
+        }
     }
     return packets;
 }
 
-void canvas::deserialize(Serial::packet p)
+bool canvas::decode(const Serial::packet_view &p, DecodedPacket &decoded)
 {
     if (p.size() == 0)
-        return;
+        return false;
     
     int command = p[0];
+    LineGroup &newGroup = decoded.group;
+    decoded.command = command;
+    
     if (command == 1)
     {
         if(p.size() % 4 != 0)
-           return;
-        LineGroup newGroup;
-        for(unsigned int i = 4; i < p.size() - 4; i += 4)
+           return false;
+        newGroup.points.reserve(p.size() / 4 - 1);
+        for(unsigned int i = 4; i < p.size(); i += 4)
+        {
+            int x = (int16_t) ((p[i+1] << 8) | p[i+0]);
+            int y = (int16_t) ((p[i+3] << 8) | p[i+2]);
+            newGroup.points.append(QPoint(x, y));
+        }
+        newGroup.color = QColor(p[1], p[2], p[3]);
+    }
+    else if (command == 2)
+    {
+        if(p.size() < 8)
+           return false;
+        int x = (int16_t) ((p[5] << 8) | p[4]);
+        int y = (int16_t) ((p[7] << 8) | p[6]);
+        newGroup.points.reserve((p.size() - 8) / 2 + 1); // at most this many, as deltas are at least a byte each
+        newGroup.points.append(QPoint(x, y));
+        int dx, dy;
+        for(unsigned int i = 8; readVarint(p, i, dx) && readVarint(p, i, dy); )
         {
-            int x1 = (int16_t) ((p[i+1] << 8) | p[i+0]);
-            int y1 = (int16_t) ((p[i+3] << 8) | p[i+2]);
-            int x2 = (int16_t) ((p[i+5] << 8) | p[i+4]);
-            int y2 = (int16_t) ((p[i+7] << 8) | p[i+6]);
-            QLine newLine(x1, y1, x2, y2);
-            newGroup.lines.append(newLine);
+            x = (int16_t) (x + dx);
+            y = (int16_t) (y + dy);
+            newGroup.points.append(QPoint(x, y));
         }
         newGroup.color = QColor(p[1], p[2], p[3]);
-        lines.append(newGroup);
+    }
+    else if (command == 3)
+    {
+        if(p.size() < strokeHeaderSize)
+           return false;
+        decoded.last = p[1] & 1;
+        decoded.strokeId = p[2] | (p[3] << 8) | (p[4] << 16) | ((quint32) p[5] << 24);
+        
+        // Decode the points, the first of which is where the chunk joins on to the stroke:
+        newGroup.points.reserve((p.size() - strokeHeaderSize) / 2 + 1);
+        int x = (int16_t) ((p[10] << 8) | p[9]);
+        int y = (int16_t) ((p[12] << 8) | p[11]);
+        newGroup.points.append(QPoint(x, y));
+        int dx, dy;
+        for(unsigned int i = strokeHeaderSize; readVarint(p, i, dx) && readVarint(p, i, dy); )
+        {
+            x = (int16_t) (x + dx);
+            y = (int16_t) (y + dy);
+            newGroup.points.append(QPoint(x, y));
+        }
+        newGroup.color = QColor(p[6], p[7], p[8]);
+    }
+    else if (command == 4 || command == 5)
+    {
+        if(p.size() < 8)
+           return false;
+        int x = (int16_t) ((p[5] << 8) | p[4]);
+        int y = (int16_t) ((p[7] << 8) | p[6]);
+        int dx, dy;
+        unsigned int i = 8;
+        if(!readVarint(p, i, dx) || !readVarint(p, i, dy))
+           return false;
+        
+        newGroup.shape = command == 4 ? LineGroup::Line : LineGroup::Rectangle;
+        newGroup.points.append(QPoint(x, y));
+        newGroup.points.append(QPoint((int16_t) (x + dx), (int16_t) (y + dy)));
+        newGroup.color = QColor(p[1], p[2], p[3]);
+    }
+    else
+    {
+        // Not a drawing element, it's handled by 'deserialize':
+        return false;
+    }
+    
+    newGroup.updateBounds();
+    return true;
+}
+
+QRect canvas::merge(const DecodedPacket &decoded)
+{
+    const LineGroup &chunk = decoded.group;
+    if(decoded.command != 3)
+    {
+        lines.append(chunk);
+        return chunk.bounds;
+    }
+    
+    int index = openStrokes.value(decoded.strokeId, -1);
+    if(index < 0)
+    {
+        // First chunk of the stroke:
+        lines.append(chunk);
+        index = lines.size() - 1;
+    }
+    else
+    {
+        // Later chunks are added to the group, and drawn straight on to the cached image if the group's
+        // already been drawn there:
+        if(index < committedCount && !committedLayer.isNull())
+        {
+            QPainter layerPainter(&committedLayer);
+            drawGroup(layerPainter, chunk);
+        }
+        lines[index].points += chunk.points.mid(1);
+        lines[index].bounds |= chunk.bounds;
+    }
+    
+    if(decoded.last)
+        openStrokes.remove(decoded.strokeId);
+    else
+        openStrokes.insert(decoded.strokeId, index);
+    return chunk.bounds;
+}
+
+void canvas::deserialize(const Serial::packet_view &p)
+{
+    if (p.size() == 0)
+        return;
+    
+    // Drawing elements are decoded and then added to the groups:
+    DecodedPacket decoded;
+    if(decode(p, decoded))
+    {
+        update(repaintArea(merge(decoded)));
+        return;
+    }
+    
+    int command = p[0];
+    if (command == 6)
+    {
+        if(p.size() < 5)
+           return;
+        
+        // Answer a sync request if there's anything to send, after a random delay, so that
+        // the other boards most likely see that another one's already answering:
+        quint32 nonce = p[1] | (p[2] << 8) | (p[3] << 16) | ((quint32) p[4] << 24);
+        if(lines.isEmpty() || syncReplyNonce != 0)
+           return;
+        
+        syncReplyNonce = nonce;
+        std::random_device random;
+        QTimer::singleShot(random() % 200, this, &canvas::answerSync);
+    }
+    else if (command == 7)
+    {
+        if(p.size() < syncHeaderSize)
+           return;
+        quint32 nonce = p[1] | (p[2] << 8) | (p[3] << 16) | ((quint32) p[4] << 24);
+        int source = p[5] | (p[6] << 8);
+        int chunk = p[7] | (p[8] << 8);
+        int chunkCount = p[9] | (p[10] << 8);
+        
+        // Another board is answering the same request. If both started, the one with the lower id carries on:
+        if(nonce == syncReplyNonce && source < boardId)
+        {
+            syncReplyNonce = 0;
+            syncOutgoing.clear();
+            syncTimer.stop();
+        }
+        
+        if(nonce != syncNonce)
+           return;
+        
+        // Switch over to the board with the lower id if it starts a snapshot too, as that one carries on:
+        if(chunk == 0 && (syncSource < 0 || source < syncSource))
+        {
+            syncSource = source;
+            syncNextChunk = 0;
+            syncData.clear();
+        }
+        if(source != syncSource)
+           return;
+        
+        // Chunks arrive in order, so a missing one means the snapshot can't be used:
+        if(chunk != syncNextChunk)
+        {
+            qWarning() << "Snapshot chunk" << syncNextChunk << "missing, giving up on syncing";
+            syncNonce = 0;
+            syncData.clear();
+            return;
+        }
+        
+        syncData.append((const char *) p.data + syncHeaderSize, p.size() - syncHeaderSize);
+        syncNextChunk++;
+        
+        if(syncNextChunk == chunkCount)
+        {
+            // Command 8 (only used in the journal): a complete snapshot, recorded as it was received.
+            Serial::packet snapshotPacket;
+            snapshotPacket.push_back(8);
+            snapshotPacket.insert(snapshotPacket.end(), syncData.constData(), syncData.constData() + syncData.size());
+            record(snapshotPacket);
+            
+            restoreSnapshot(syncData);
+            syncNonce = 0;
+            syncData.clear();
+        }
+    }
+    else if (command == 8)
+    {
+        restoreSnapshot(QByteArray((const char *) p.data + 1, p.size() - 1));
     }
     else if (command == 0)
     {
-       lines.clear();
+       clearLines();
+       update();
     }
-    update();
 }
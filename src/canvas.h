@@ -4,53 +4,221 @@
 #include <QObject>
 #include <QWidget>
 #include <QString>
+#include <QStringList>
 #include <QLine>
 #include <QDebug>
 #include <QMouseEvent>
 #include <QPoint>
+#include <QPointF>
 #include <QAction>
 #include <QList>
 #include <QPainter>
 #include <QPaintEvent>
 #include <QPen>
 #include <QColor>
+#include <QImage>
+#include <QRect>
+#include <QVector>
+#include <QPair>
+#include <QHash>
+#include <QElapsedTimer>
+#include <QTimer>
+#include <QByteArray>
+#include <QThread>
+#include <QMetaType>
 
 #include "serial.hpp"
+#include "journal.hpp"
+#include "histogram.hpp"
+#include "tracer.hpp"
+
+class PacketDecoder;
 
 class canvas : public QWidget
 {
     Q_OBJECT
 public:
+    struct LineGroup
+    {
+        QColor color;
+        QBrush brush;
+        enum Shape
+        {
+            Polyline,  // the lines join each point to the next one
+            Line,      // a line between the two points
+            Rectangle  // a rectangle with the two points as opposite corners
+        };
+        
+        Shape shape = Polyline;
+        QVector<QPoint> points; // points defining the shape
+        QRect bounds;           // bounding box of the points
+        
+        void updateBounds(); // recalculates the bounding box from the points
+    };
+    
+    // A received packet, decoded on the decoder thread so that the GUI thread only has to add it to the groups.
+    struct DecodedPacket
+    {
+        int command = -1;
+        bool drawing = false;  // whether the packet is a drawing element, decoded into 'group'
+        LineGroup group;       // the drawing element (for a stroke chunk, just the chunk)
+        quint32 strokeId = 0;  // stroke the chunk belongs to
+        bool last = false;     // whether the chunk is the last one of the stroke
+        Serial::packet bytes;  // the packet itself, for packets that aren't drawing elements (and for the journal, if there is one)
+        quint32 traceId = 0;   // id of the packet in the trace (when tracing)
+        std::chrono::steady_clock::time_point received; // when the packet was taken from the receive buffer
+    };
+    
     explicit canvas(QWidget *parent = 0);
+    ~canvas();
     void mouseMoveEvent(QMouseEvent *event);
     void mousePressEvent(QMouseEvent *event);
     void mouseReleaseEvent(QMouseEvent *event);
+    
+    // Sets how pen strokes are simplified before they're sent: points closer than minDistance pixels are
+    // dropped, then the stroke is simplified so that no point moves more than tolerance pixels (0 to disable).
+    // No point of the stroke ends up minDistance + tolerance pixels or more from the line that's sent.
+    void setSimplification(double tolerance, int minDistance);
+    
+    // Sets how the pointer's movements are turned into pen strokes: the path is smoothed by the given factor from
+    // 0 (none) to just under 1 (the most), then resampled by keeping a position once it's resampleStep pixels from
+    // the last point kept (0 keeps every movement). The movements are added once per display frame either way.
+    void setInputFiltering(double resampleStep, double smoothing);
+    
+    // Sets the maximum size of the packets sent, which should be the limit of the serial instance they're sent on.
+    void setPacketLimit(std::size_t limit);
+    
+    // Sets how often pen strokes are sent while they're being drawn, in milliseconds
+    // (0 to only send strokes once they're finished).
+    void setStreaming(int intervalMillis);
+    
+    // Sets the serial instance the packets are sent on, so that snapshots sent to other boards can wait for it to be idle.
+    void setSerial(Serial *serial);
+    
+    // Asks the other boards for a snapshot of what's been drawn so far (for a board joining a session late).
+    void requestSync();
+    
+    // Sets the journal the packets drawn and received are recorded in, after rebuilding the board from what's in it.
+    void setJournal(Journal *journal);
+    
+    // Sets the tracer the stages of the packets sent and received are recorded in, as the given node.
+    void setTracer(Tracer *tracer, int node);
+    
+    // Returns a summary of the statistics of the canvas and of the serial instance it sends on, one per line.
+    QString statisticsText();
+    
+    // Decodes a packet if it's a drawing element, returning false if it isn't. Doesn't touch the canvas,
+    // so it can be called from any thread.
+    static bool decode(const Serial::packet_view &p, DecodedPacket &decoded);
 
 protected:
     void paintEvent(QPaintEvent *) override; // updates drawing elements on window
 
 signals:
-    void sendPacket(Serial::packet changedPacket); // emitted when a new packet is ready to be sent
+    void sendPacket(Serial::packet changedPacket, int priority, quint32 key = 0); // emitted when a new packet is ready to be sent
+    void cancelPackets();                                                         // emitted when the packets not sent yet are no longer needed
 
 public slots:
     void selectTool(QAction* tool);      // updates the selected tool after a toolbar action
     void selectColor(QAction* color);    // updates the selected color after a toolbar action
-    void packetReceived(Serial* serial); // used tp receive packets of drawing elements
+    void showStatistics(bool show);      // shows or hides the statistics overlay
 
 private:
-    struct LineGroup
-    {
-        QColor color;
-        QBrush brush;
-        QList<QLine> lines;
-    };
+    friend class CanvasBenchmark; // drives the encoding, decoding and painting directly
+    friend class StrokeTest;      // checks how strokes are simplified
     
-    QList<LineGroup> lines; // list of groups of drawing elements
+    QVector<LineGroup> lines; // list of groups of drawing elements
     LineGroup currentLines; // group of lines currently being drawn
+    
+    QImage committedLayer;  // cached image of the groups in 'lines', so they aren't redrawn on every update
+    int committedCount = 0; // number of groups from 'lines' drawn onto the cached image
     QString toolType;       // option selected on the window toolbar
     
+    histogram paintTime;            // microseconds taken by each paint event
+    bool statisticsVisible = false; // whether the statistics overlay is shown
+    QString statisticsCache;        // text shown in the overlay, refreshed by 'statisticsTimer'
+    QRect statisticsArea;           // area the overlay was last drawn in
+    QTimer statisticsTimer;         // refreshes the overlay
+    
+    void refreshStatistics(); // updates the overlay text and repaints it
+    
+    Tracer *tracer = nullptr;                           // tracer for the packets' stages (if tracing)
+    int traceNode = 0;                                  // node the stages are recorded as
+    std::chrono::steady_clock::time_point unsentMove;   // time of the first pen movement not sent yet (when tracing)
+    QVector<quint32> unpaintedPackets;                  // packets decoded since the last paint (when tracing)
+    
+    QVector<QPoint> pendingInput; // pointer positions received since the last frame
+    QPoint lastInput;             // last pointer position received
+    QTimer inputTimer;            // adds the pending pointer positions to the drawing once per display frame
+    double resampleStep = 3.0;    // minimum distance in pixels between the points kept from the pointer's path (0 keeps them all)
+    double smoothing = 0.0;       // weight of the previous position when smoothing the pointer's path (0 to disable)
+    QPointF smoothedInput;        // smoothed pointer position
+    QPointF resampledInput;       // last point kept from the pointer's path, before rounding
+    quint64 inputEvents = 0;      // pointer movements received
+    quint64 inputFrames = 0;      // frames the pointer movements were added in
+    quint64 inputPoints = 0;      // points kept from the pointer movements
+    
+    void processInput(); // adds the pointer positions received since the last frame to the drawing
+    void finishInput();  // adds any pending pointer positions, and the end of the stroke, when the pointer is released
+    
+    double simplifyTolerance = 1.0; // maximum distance in pixels of a dropped point from the simplified stroke
+    int minPointDistance = 2;       // minimum distance in pixels between the points of a stroke
+    
+    std::size_t packetLimit = Serial::max_packet_size; // maximum size of the packets sent
+    
+    int streamInterval = 100;     // milliseconds between chunks of a pen stroke sent while it's drawn (0 to disable)
+    QElapsedTimer streamTimer;    // time since the last chunk of the current stroke was sent
+    int streamedPoints = 0;       // number of points of the current stroke sent so far
+    quint32 strokeId = 0;         // id of the current stroke, so the receivers can join its chunks together
+    quint32 nextStrokeId;
+    int queuedChunkFrom = -1;     // first point of the last chunk sent, while it may still be waiting to be sent (-1 if none)
+    quint32 queuedChunkKey = 0;   // key the last chunk was sent with, for replacing it by one carrying on to the new points
+    quint32 nextChunkKey = 1;
+    QHash<quint32, int> openStrokes; // index in 'lines' of the strokes still being received, by stroke id
+    
+    static const unsigned int strokeHeaderSize = 13; // bytes before the first delta of a stroke chunk
+    
+    Serial *serial = nullptr;         // serial instance the packets are sent on
+    QThread decoderThread;            // thread the received packets are decoded on
+    PacketDecoder *decoder = nullptr; // decoder running on 'decoderThread', which deletes it
+    Journal *journal = nullptr;       // journal the packets are recorded in
+    quint16 boardId;                  // random id of this board, telling apart the snapshots sent by different boards
+    
+    quint32 syncNonce = 0;    // id of the sync request waiting for a snapshot (0 if none)
+    int syncSource = -1;      // board whose snapshot is being received (-1 until its first chunk)
+    int syncNextChunk = 0;    // index of the next snapshot chunk expected
+    QByteArray syncData;      // compressed snapshot received so far
+    
+    quint32 syncReplyNonce = 0;         // id of the sync request being answered (0 if none)
+    QList<Serial::packet> syncOutgoing; // snapshot chunks still to be sent
+    QTimer syncTimer;                   // sends the next snapshot chunk whenever the serial instance is idle
+    
+    static const unsigned int syncHeaderSize = 11; // bytes before the data of a snapshot chunk
+    
+    void answerSync();    // starts sending a snapshot in reply to a sync request
+    void sendSyncChunk(); // sends the next snapshot chunk, if nothing else is waiting to be sent
+    
+    QByteArray snapshot();                              // compressed encoding of all the groups
+    void restoreSnapshot(const QByteArray &compressed); // adds the groups from a snapshot before the existing ones
+    
+    QVector<QPoint> simplifyStroke(const QVector<QPoint> &stroke); // simplification of a pen stroke
+    void flushStroke(bool last);                                    // sends the unsent part of the current stroke
+    QList<Serial::packet> serializeStroke(int from, bool last);     // serialization of the current stroke from a point
+    
+    void drawGroup(QPainter &painter, const LineGroup &group); // draws one group of lines
+    void clearLines();                                          // removes all the drawing elements
+    
+    void sendPackets(const QList<Serial::packet> &packets, quint32 key = 0); // records and sends the packets for what's been drawn here
+    void traceSerialized(const Serial::packet &p);                          // traces a packet (and the movement that led to it) being sent
+    void record(const Serial::packet &p);                                   // records a packet in the journal
+    void record(const Serial::packet_view &p);
+    
     QList<Serial::packet> serialize();  // serialization of current drawing tool into packets
-    void deserialize(Serial::packet p); // deserialization of drawing elements from packet
+    void deserialize(const Serial::packet_view &p); // deserialization of drawing elements from packet
+    QRect merge(const DecodedPacket &decoded);      // adds a decoded drawing element to the groups, returning its bounds
+    void applyDecoded(const QVector<DecodedPacket> &batch); // adds a batch of packets from the decoder thread
 };
 
+Q_DECLARE_METATYPE(canvas::DecodedPacket)
+
 #endif // CANVAS_H
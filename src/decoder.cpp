@@ -0,0 +1,51 @@
+#include "decoder.h"
+
+PacketDecoder::PacketDecoder(QObject *parent) : QObject(parent)
+{
+}
+
+void PacketDecoder::setKeepDrawingBytes(bool keep)
+{
+    keepDrawingBytes = keep;
+}
+
+void PacketDecoder::setTraceIds(bool trace)
+{
+    traceIds = trace;
+}
+
+canvas::DecodedPacket PacketDecoder::decode(const Serial::packet_view &p)
+{
+    canvas::DecodedPacket packet;
+    packet.received = std::chrono::steady_clock::now();
+    packet.drawing = canvas::decode(p, packet);
+    
+    // The canvas only needs the bytes of a drawing element to record it, as it's been decoded already:
+    if(!packet.drawing || keepDrawingBytes)
+        packet.bytes.assign(p.begin(), p.end());
+    if(traceIds)
+        packet.traceId = Tracer::packet_id(p.data, p.size());
+    return packet;
+}
+
+void PacketDecoder::decodePackets(Serial *serial)
+{
+    QVector<canvas::DecodedPacket> batch;
+    batch.reserve(batchSize);
+    
+    // Decode each packet straight out of the receive buffer:
+    for(Serial::packet_view p = serial->peek_view(); !p.empty(); p = serial->peek_view())
+    {
+        batch.append(decode(p));
+        serial->release();
+        
+        if(batch.size() == batchSize)
+        {
+            emit decoded(batch);
+            batch.clear();
+        }
+    }
+    
+    if(!batch.isEmpty())
+        emit decoded(batch);
+}
@@ -0,0 +1,42 @@
+#ifndef DECODER_H
+#define DECODER_H
+
+#include <QObject>
+#include <QVector>
+
+#include <atomic>
+
+#include "canvas.h"
+#include "serial.hpp"
+
+// Decodes received packets on its own thread, so that a burst of packets doesn't hold up the GUI thread.
+// The decoded packets are handed over to the canvas in batches, to be added to the groups and repainted together.
+class PacketDecoder : public QObject
+{
+    Q_OBJECT
+public:
+    explicit PacketDecoder(QObject *parent = 0);
+    
+    // Set whether the drawing packets are copied (for the journal) and whether the packets' trace ids are worked out
+    // (for the tracer). Packets which aren't drawing elements are always copied. Can be called from any thread.
+    void setKeepDrawingBytes(bool keep);
+    void setTraceIds(bool trace);
+    
+    canvas::DecodedPacket decode(const Serial::packet_view &p); // decodes a single packet, copying it only if needed
+
+public slots:
+    void decodePackets(Serial *serial); // decodes the packets in a serial instance's receive buffer, until it's empty
+
+signals:
+    void decoded(QVector<canvas::DecodedPacket> batch); // emitted with each batch of decoded packets
+
+private:
+    friend class CanvasBenchmark; // feeds bursts of packets through the decoder in batches
+    
+    static const int batchSize = 256; // most packets in a batch, so that the canvas sees progress during long bursts
+    
+    std::atomic<bool> keepDrawingBytes{false};
+    std::atomic<bool> traceIds{false};
+};
+
+#endif // DECODER_H
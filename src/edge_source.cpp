@@ -0,0 +1,117 @@
+#include "edge_source.hpp"
+
+#include <wiringPi.h>
+#include <linux/gpio.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <time.h>
+#include <string.h>
+#include <algorithm>
+
+GpioEdgeSource::GpioEdgeSource(int pin_a, int pin_b, const char *chip)
+{
+    pins[0] = pin_a;
+    pins[1] = pin_b;
+    fds[0] = fds[1] = -1;
+    
+    int chip_fd = open(chip, O_RDONLY);
+    if (chip_fd < 0)
+        return;
+    
+    for (int i = 0; i < 2; i++)
+    {
+        struct gpioevent_request request;
+        memset(&request, 0, sizeof(request));
+        request.lineoffset = wpiPinToGpio(pins[i]);
+        request.handleflags = GPIOHANDLE_REQUEST_INPUT;
+        request.eventflags = GPIOEVENT_REQUEST_BOTH_EDGES;
+        strncpy(request.consumer_label, "pi-whiteboard", sizeof(request.consumer_label) - 1);
+        
+        if (ioctl(chip_fd, GPIO_GET_LINEEVENT_IOCTL, &request) < 0)
+            break;
+        
+        // Non-blocking, so that all queued events can be drained after a poll:
+        fcntl(request.fd, F_SETFL, fcntl(request.fd, F_GETFL) | O_NONBLOCK);
+        fds[i] = request.fd;
+    }
+    
+    close(chip_fd);
+}
+
+GpioEdgeSource::~GpioEdgeSource()
+{
+    for (int i = 0; i < 2; i++)
+    {
+        if (fds[i] >= 0)
+            close(fds[i]);
+    }
+}
+
+bool GpioEdgeSource::valid() const
+{
+    return fds[0] >= 0 && fds[1] >= 0;
+}
+
+bool GpioEdgeSource::wait_edge(edge &e, long timeout_micros)
+{
+    if (pending.empty())
+    {
+        struct pollfd poll_fds[2];
+        for (int i = 0; i < 2; i++)
+        {
+            poll_fds[i].fd = fds[i];
+            poll_fds[i].events = POLLIN | POLLPRI;
+            poll_fds[i].revents = 0;
+        }
+        
+        int timeout_millis = timeout_micros < 0 ? -1 : (timeout_micros + 999) / 1000;
+        if (poll(poll_fds, 2, timeout_millis) <= 0)
+            return false;
+        
+        for (int i = 0; i < 2; i++)
+        {
+            if (poll_fds[i].revents & (POLLIN | POLLPRI))
+                read_edges(i);
+        }
+        
+        // Both lines may have changed since the last poll, so restore the order they happened in:
+        std::stable_sort(pending.begin(), pending.end(), [] (const edge &a, const edge &b) {
+            return a.timestamp < b.timestamp;
+        });
+        
+        if (pending.empty())
+            return false;
+    }
+    
+    e = pending.front();
+    pending.pop_front();
+    return true;
+}
+
+void GpioEdgeSource::read_edges(int index)
+{
+    struct timespec now_ts;
+    clock_gettime(CLOCK_MONOTONIC, &now_ts);
+    long long now_nanos = now_ts.tv_sec * 1000000000LL + now_ts.tv_nsec;
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    
+    struct gpioevent_data data;
+    while (::read(fds[index], &data, sizeof(data)) == sizeof(data))
+    {
+        edge e;
+        e.pin = pins[index];
+        e.rising = data.id == GPIOEVENT_EVENT_RISING_EDGE;
+        
+        // Recent kernels timestamp events with CLOCK_MONOTONIC, older ones with CLOCK_REALTIME.
+        // Only trust the timestamp if it's on our clock, otherwise use the time it was read:
+        long long age_nanos = now_nanos - (long long) data.timestamp;
+        if (0 <= age_nanos && age_nanos < 1000000000LL)
+            e.timestamp = now - std::chrono::nanoseconds(age_nanos);
+        else
+            e.timestamp = now;
+        
+        pending.push_back(e);
+    }
+}
@@ -0,0 +1,69 @@
+#ifndef EDGE_SOURCE_HPP
+#define EDGE_SOURCE_HPP
+
+#include <deque>
+#include <chrono>
+
+/**
+ * Source of pin change events, used by 'Serial' as an alternative to polling the pins.
+ * Implementations can be backed by real hardware or by a fake for testing.
+ */
+class EdgeSource
+{
+public:
+    /**
+     * A single pin change and the time at which it happened.
+     */
+    struct edge
+    {
+        int pin;
+        bool rising;
+        std::chrono::steady_clock::time_point timestamp;
+    };
+    
+    virtual ~EdgeSource() {}
+    
+    /**
+     * Blocks until a pin changes, or until the timeout, and returns whether an edge was received.
+     * Use a negative timeout to wait indefinitely.
+     */
+    virtual bool wait_edge(edge &e, long timeout_micros) = 0;
+};
+
+/**
+ * Edge source using the Linux GPIO character device, so the kernel wakes us up on edges.
+ * Pins are given as wiringPi pin numbers, so 'wiringPiSetup' must have been called before.
+ */
+class GpioEdgeSource : public EdgeSource
+{
+public:
+    /**
+     * Constructor, specifying the pins to watch and the GPIO chip device.
+     */
+    GpioEdgeSource(int pin_a, int pin_b, const char *chip = "/dev/gpiochip0");
+    
+    /**
+     * Releases the GPIO lines.
+     */
+    ~GpioEdgeSource();
+    
+    /**
+     * Returns whether the GPIO lines could be requested from the kernel.
+     */
+    bool valid() const;
+    
+    bool wait_edge(edge &e, long timeout_micros) override;
+    
+private:
+    // wiringPi pin numbers and the line event file descriptors for each.
+    int pins[2];
+    int fds[2];
+    
+    // Edges read from the kernel but not yet returned, in timestamp order.
+    std::deque<edge> pending;
+    
+    // Reads all the edges available on the given line into 'pending'.
+    void read_edges(int index);
+};
+
+#endif /* EDGE_SOURCE_HPP */
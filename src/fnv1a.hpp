@@ -0,0 +1,32 @@
+#ifndef FNV1A_HPP
+#define FNV1A_HPP
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * 32-bit FNV-1a hash, used to identify packets (for checking probes and for tracing) on both sides of the bus.
+ * Hashes can be worked out a byte at a time, starting from 'fnv1a_basis', or over a whole buffer at once.
+ */
+static const uint32_t fnv1a_basis = 2166136261u;
+
+/**
+ * Adds a byte to a hash.
+ */
+inline uint32_t fnv1a(uint32_t hash, unsigned char byte)
+{
+    return (hash ^ byte) * 16777619u;
+}
+
+/**
+ * Returns the hash of some bytes.
+ */
+inline uint32_t fnv1a(const unsigned char *data, std::size_t length)
+{
+    uint32_t hash = fnv1a_basis;
+    for (std::size_t i = 0; i < length; i++)
+        hash = fnv1a(hash, data[i]);
+    return hash;
+}
+
+#endif /* FNV1A_HPP */
@@ -0,0 +1,61 @@
+#ifndef HISTOGRAM_HPP
+#define HISTOGRAM_HPP
+
+#include <cstdint>
+#include <algorithm>
+
+/**
+ * Histogram of durations (or any other non-negative values) with power of two buckets, cheap enough to add to
+ * on every packet. Bucket 0 counts values of 0, and bucket i counts values from 2^(i-1) up to 2^i - 1,
+ * with the last bucket also counting anything bigger.
+ */
+struct histogram
+{
+    static const int bucket_count = 24;
+    
+    uint64_t buckets[bucket_count] = {};
+    uint64_t count = 0;
+    uint64_t total = 0;
+    uint64_t max = 0;
+    
+    /**
+     * Adds a value to the histogram.
+     */
+    void add(uint64_t value)
+    {
+        int bucket = 0;
+        for (uint64_t rest = value; rest && bucket < bucket_count - 1; rest >>= 1)
+            bucket++;
+        
+        buckets[bucket]++;
+        count++;
+        total += value;
+        if (value > max)
+            max = value;
+    }
+    
+    /**
+     * Returns the mean of the values added, or 0 if there aren't any.
+     */
+    double mean() const
+    {
+        return count ? (double) total / count : 0;
+    }
+    
+    /**
+     * Returns an upper bound for the given percentile (from 0 to 100), being the top of the bucket it falls in.
+     */
+    uint64_t percentile(double percent) const
+    {
+        uint64_t seen = 0;
+        for (int bucket = 0; bucket < bucket_count; bucket++)
+        {
+            seen += buckets[bucket];
+            if (seen > 0 && seen >= percent / 100 * count)
+                return bucket == bucket_count - 1 ? max : std::min(max, ((uint64_t) 1 << bucket) - 1);
+        }
+        return max;
+    }
+};
+
+#endif /* HISTOGRAM_HPP */
@@ -0,0 +1,165 @@
+#include "journal.hpp"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <algorithm>
+
+// The file starts with this, followed by the number of bytes in use (including the header).
+static const char journal_magic[8] = { 'P', 'W', 'J', 'O', 'U', 'R', 'N', '1' };
+static const std::size_t header_size = 16;
+
+// Each record is a 4 byte length (least significant byte first) followed by the packet.
+static const std::size_t record_header_size = 4;
+
+Journal::Journal(const std::string &path, std::size_t initial_size) :
+    initial_size(std::max(initial_size, header_size))
+{
+    fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+        return;
+    
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !map(std::max((std::size_t) st.st_size, this->initial_size)))
+    {
+        close(fd);
+        fd = -1;
+        return;
+    }
+    
+    // Start again if this isn't a journal, or if it's been damaged:
+    if (memcmp(base, journal_magic, sizeof(journal_magic)) != 0 || used() < header_size || used() > mapped_size)
+    {
+        memcpy(base, journal_magic, sizeof(journal_magic));
+        set_used(header_size);
+    }
+    
+    // Count the records, dropping any which don't fit in the log (which can't normally happen):
+    std::size_t pos = header_size;
+    while (pos + record_header_size <= used())
+    {
+        const unsigned char *record = base + pos;
+        std::size_t length = record[0] | (record[1] << 8) | (record[2] << 16) | ((std::size_t) record[3] << 24);
+        if (pos + record_header_size + length > used())
+            break;
+        
+        pos += record_header_size + length;
+        record_count++;
+    }
+    set_used(pos);
+}
+
+Journal::~Journal()
+{
+    if (base)
+    {
+        msync(base, mapped_size, MS_SYNC);
+        munmap(base, mapped_size);
+    }
+    if (fd >= 0)
+        close(fd);
+}
+
+bool Journal::valid() const
+{
+    return base != nullptr;
+}
+
+bool Journal::append(const unsigned char *data, std::size_t length)
+{
+    if (!base)
+        return false;
+    
+    // Double the size of the file whenever it runs out of room, so that remapping is rare:
+    std::size_t pos = used();
+    std::size_t needed = pos + record_header_size + length;
+    if (needed > mapped_size && !map(std::max(needed, 2 * mapped_size)))
+        return false;
+    
+    unsigned char *record = base + pos;
+    record[0] = (length >> 0) & 0xFF;
+    record[1] = (length >> 8) & 0xFF;
+    record[2] = (length >> 16) & 0xFF;
+    record[3] = (length >> 24) & 0xFF;
+    memcpy(record + record_header_size, data, length);
+    
+    // The record only becomes part of the log once it's completely written:
+    set_used(needed);
+    record_count++;
+    return true;
+}
+
+void Journal::clear()
+{
+    if (!base)
+        return;
+    
+    set_used(header_size);
+    record_count = 0;
+    
+    if (mapped_size > initial_size)
+        map(initial_size);
+}
+
+void Journal::replay(const std::function<void(const packet_view &)> &handler) const
+{
+    if (!base)
+        return;
+    
+    std::size_t end = used();
+    for (std::size_t pos = header_size; pos + record_header_size <= end; )
+    {
+        const unsigned char *record = base + pos;
+        
+        packet_view p;
+        p.data = record + record_header_size;
+        p.length = record[0] | (record[1] << 8) | (record[2] << 16) | ((std::size_t) record[3] << 24);
+        handler(p);
+        
+        pos += record_header_size + p.length;
+    }
+}
+
+std::size_t Journal::size() const
+{
+    return record_count;
+}
+
+bool Journal::map(std::size_t size)
+{
+    // The new mapping is made before the old one goes, so that the journal is still usable if it fails:
+    if (size > mapped_size && ftruncate(fd, size) < 0)
+        return false;
+    
+    void *mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED)
+        return false;
+    
+    if (base)
+        munmap(base, mapped_size);
+    
+    // The file can only shrink once the old mapping is gone (if it can't, it just stays bigger than it needs to be):
+    if (size < mapped_size)
+    {
+        int result = ftruncate(fd, size);
+        (void) result;
+    }
+    
+    base = (unsigned char *) mapping;
+    mapped_size = size;
+    return true;
+}
+
+uint64_t Journal::used() const
+{
+    uint64_t used;
+    memcpy(&used, base + sizeof(journal_magic), sizeof(used));
+    return used;
+}
+
+void Journal::set_used(uint64_t used)
+{
+    memcpy(base + sizeof(journal_magic), &used, sizeof(used));
+}
@@ -0,0 +1,78 @@
+#ifndef JOURNAL_HPP
+#define JOURNAL_HPP
+
+#include <string>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+
+#include "packet_ring.hpp"
+
+/**
+ * Append-only log of packets in a memory-mapped file, so that a board can be rebuilt after a restart
+ * without asking the other boards for it. Records are stored as binary (a 4 byte length followed by the packet),
+ * and are replayed straight out of the mapping without copying them.
+ *
+ * The file stays consistent if the program is killed part way through an append, as the length of the log
+ * in the file header is only updated once a record is completely written.
+ */
+class Journal
+{
+public:
+    /**
+     * Opens or creates the journal file. The file is extended as needed, starting from the given size.
+     * An existing file which isn't a journal is started again from empty.
+     */
+    Journal(const std::string &path, std::size_t initial_size = 1 << 20);
+    
+    /**
+     * Flushes the journal to the file and unmaps it.
+     */
+    ~Journal();
+    
+    /**
+     * Returns whether the file could be opened and mapped.
+     */
+    bool valid() const;
+    
+    /**
+     * Adds a packet to the end of the journal. Returns false if the file couldn't be extended to fit it.
+     */
+    bool append(const unsigned char *data, std::size_t length);
+    
+    /**
+     * Removes all the packets from the journal and shrinks the file back to its initial size,
+     * for when everything in it has been made obsolete (e.g. by a clear).
+     */
+    void clear();
+    
+    /**
+     * Calls the given function with each packet in the journal, in the order they were added.
+     * The views point into the mapping, so they're only valid until the next append or clear.
+     */
+    void replay(const std::function<void(const packet_view &)> &handler) const;
+    
+    /**
+     * Returns the number of packets in the journal.
+     */
+    std::size_t size() const;
+    
+private:
+    int fd = -1;
+    
+    // The mapping of the whole file, its size, and the size it's shrunk back to when cleared.
+    unsigned char *base = nullptr;
+    std::size_t mapped_size = 0;
+    std::size_t initial_size;
+    
+    std::size_t record_count = 0;
+    
+    // Maps the file at the given size (extending or shrinking it), unmapping any previous mapping.
+    bool map(std::size_t size);
+    
+    // Bytes of the log in use, including the header, as stored in the file header.
+    uint64_t used() const;
+    void set_used(uint64_t used);
+};
+
+#endif /* JOURNAL_HPP */
@@ -1,9 +1,19 @@
 #include <QApplication>
 #include <QObject>
+#include <QTimer>
+#include <QElapsedTimer>
 
 #include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <sstream>
 
 #include "serial.hpp"
+#include "simulated_bus.hpp"
+#include "journal.hpp"
+#include "tracer.hpp"
 #include "window.h"
 #include "ui_window.h"
 
@@ -11,32 +21,199 @@ int main(int argc, char *argv[])
 {
     int pin_scl = 0;
     int pin_sda = 1;
+    int simulated_nodes = 0;
+    double simplify_tolerance = 1.0;
+    int min_point_distance = 2;
+    int stream_interval = 100;
+    double resample_step = 3.0;
+    double smoothing = 0;
+    double bit_error_rate = 0;
+    std::string journal_path;
+    double stats_interval = 0;
+    std::string stats_path;
+    std::string trace_path;
+    Serial::options serial_options;
     
-    if (argc == 3)
+    // Separate the options from the positional pin arguments:
+    std::vector<char *> pin_args;
+    for (int i = 1; i < argc; i++)
     {
-        char *arg1 = argv[1];
-        char *arg2 = argv[2];
+        std::string arg = argv[i];
+        
+        if (arg == "--events")
+            serial_options.edge_events = true;
+        else if (arg == "--bitrate" && i + 1 < argc)
+            serial_options.bitrate = atoi(argv[++i]);
+        else if (arg == "--probe" && i + 1 < argc)
+            serial_options.probe_bitrate = atoi(argv[++i]);
+        else if (arg == "--simulate" && i + 1 < argc)
+            simulated_nodes = atoi(argv[++i]);
+        else if (arg == "--simplify" && i + 1 < argc)
+            simplify_tolerance = atof(argv[++i]);
+        else if (arg == "--min-distance" && i + 1 < argc)
+            min_point_distance = atoi(argv[++i]);
+        else if (arg == "--stream" && i + 1 < argc)
+            stream_interval = atoi(argv[++i]);
+        else if (arg == "--resample" && i + 1 < argc)
+            resample_step = atof(argv[++i]);
+        else if (arg == "--smooth" && i + 1 < argc)
+            smoothing = atof(argv[++i]);
+        else if (arg == "--extended" && i + 1 < argc)
+        {
+            serial_options.extended_length = true;
+            serial_options.extended_max_packet = atoi(argv[++i]);
+        }
+        else if (arg == "--crc")
+            serial_options.crc = true;
+        else if (arg == "--data-pins" && i + 1 < argc)
+        {
+            // Comma separated list of the extra SDA pins:
+            std::stringstream pins(argv[++i]);
+            std::string pin;
+            while (std::getline(pins, pin, ','))
+                serial_options.extra_data_pins.push_back(atoi(pin.c_str()));
+        }
+        else if (arg == "--priorities")
+            serial_options.priorities = true;
+        else if (arg == "--fair")
+            serial_options.fair_access = true;
+        else if (arg == "--retries" && i + 1 < argc)
+            serial_options.max_retries = atoi(argv[++i]);
+        else if (arg == "--bit-errors" && i + 1 < argc)
+            bit_error_rate = atof(argv[++i]);
+        else if (arg == "--journal" && i + 1 < argc)
+            journal_path = argv[++i];
+        else if (arg == "--stats" && i + 1 < argc)
+            stats_interval = atof(argv[++i]);
+        else if (arg == "--stats-file" && i + 1 < argc)
+            stats_path = argv[++i];
+        else if (arg == "--trace" && i + 1 < argc)
+            trace_path = argv[++i];
+        else
+            pin_args.push_back(argv[i]);
+    }
+    
+    if (pin_args.size() == 2)
+    {
+        char *arg1 = pin_args[0];
+        char *arg2 = pin_args[1];
         
         pin_scl = atoi(arg1);
         pin_sda = atoi(arg2);
+    }
+    
+    std::string problem = Serial::check_options(pin_scl, pin_sda, serial_options);
+    if (!problem.empty())
+    {
+        std::cout << problem << std::endl;
+        exit(1);
+    }
+    
+    const std::vector<int> &extra_pins = serial_options.extra_data_pins;
+    std::cout << "SCL pin: " << pin_scl << (extra_pins.empty() ? ", SDA pin: " : ", SDA pins: ") << pin_sda;
+    for (int pin : extra_pins)
+        std::cout << ", " << pin;
+    std::cout << ", bitrate: " << serial_options.bitrate << std::endl;
+    
+    // setup Qt GUI
+    QApplication a(argc, argv);
+    
+    // When simulating, each window gets its own node on an in-process bus instead of using the GPIO pins.
+    // The bus is declared first so that it outlives the nodes owned by the serial instances.
+    SimulatedBus bus;
+    bus.set_bit_errors(pin_scl, pin_sda, bit_error_rate);
+    int node_count = simulated_nodes > 0 ? simulated_nodes : 1;
+    
+    // The tracer and the journals are declared before the windows and the serial instances, so that they outlive them.
+    // The trace is written out when the tracer is destroyed. The serial instances outlive the windows, as each canvas
+    // decodes its serial instance's packets on a thread which is only stopped when the canvas is destroyed.
+    std::unique_ptr<Tracer> tracer(trace_path.empty() ? nullptr : new Tracer(trace_path));
+    std::vector<std::unique_ptr<Journal>> journals;
+    std::vector<std::unique_ptr<Serial>> serials;
+    std::vector<std::unique_ptr<Window>> windows;
+    
+    for (int i = 0; i < node_count; i++)
+    {
+        Window *window = new Window();
+        Serial *serial;
         
-        if (pin_scl == pin_sda)
+        if (simulated_nodes > 0)
+        {
+            serial = new Serial(bus.connect(), pin_scl, pin_sda, serial_options);
+            window->setWindowTitle(QString("pi-whiteboard (node %1)").arg(i));
+        }
+        else
         {
-            std::cout << "SCL and SDA pins cannot be the same." << std::endl;
-            exit(1);
+            serial = new Serial(pin_scl, pin_sda, serial_options);
         }
+        
+        window->ui->centralWidget->setSimplification(simplify_tolerance, min_point_distance);
+        window->ui->centralWidget->setStreaming(stream_interval);
+        window->ui->centralWidget->setInputFiltering(resample_step, smoothing);
+        window->ui->centralWidget->setPacketLimit(serial->packet_limit());
+        window->ui->centralWidget->setSerial(serial);
+        
+        // Trace the stages of each packet, with each node as a process in the trace:
+        if (tracer)
+        {
+            Tracer *node_tracer = tracer.get();
+            serial->set_trace_hook([node_tracer, i] (const char *stage, uint32_t packet_id) {
+                node_tracer->trace(i, stage, packet_id);
+            });
+            window->ui->centralWidget->setTracer(node_tracer, i);
+        }
+        
+        windows.emplace_back(window);
+        serials.emplace_back(serial);
+        
+        QObject::connect(window->ui->centralWidget, &canvas::sendPacket, serial, &Serial::write_prioritized);
+        QObject::connect(window->ui->centralWidget, &canvas::cancelPackets, serial, &Serial::cancel_pending);
+        
+        // Rebuild the board from the journal, if there is one (each simulated node gets its own):
+        Journal *journal = nullptr;
+        if (!journal_path.empty())
+        {
+            std::string path = simulated_nodes > 0 ? journal_path + "." + std::to_string(i) : journal_path;
+            journal = new Journal(path);
+            journals.emplace_back(journal);
+            
+            if (journal->valid())
+                window->ui->centralWidget->setJournal(journal);
+            else
+                std::cout << "Couldn't open the journal " << path << "." << std::endl;
+        }
+        
+        window->show();
+        
+        // Catch up with anything drawn on the other boards before this one started, unless the journal had it:
+        if (!journal || journal->size() == 0)
+            window->ui->centralWidget->requestSync();
+    }
+    
+    if (serial_options.edge_events && !serials[0]->edge_events())
+        std::cout << "Edge events unavailable, polling the pins instead." << std::endl;
+    
+    // Periodically write out the statistics of each node, to the standard output or appended to a file:
+    QTimer stats_timer;
+    QElapsedTimer uptime;
+    std::ofstream stats_file;
+    if (stats_interval > 0)
+    {
+        if (!stats_path.empty())
+            stats_file.open(stats_path, std::ios::app);
+        std::ostream *stats_out = stats_file.is_open() ? (std::ostream *) &stats_file : &std::cout;
+        
+        uptime.start();
+        QObject::connect(&stats_timer, &QTimer::timeout, [&, stats_out] () {
+            *stats_out << "--- " << uptime.elapsed() / 1000.0 << " s" << std::endl;
+            for (std::size_t i = 0; i < windows.size(); i++)
+            {
+                QString text = windows[i]->ui->centralWidget->statisticsText();
+                *stats_out << "node " << i << ":\n  " << text.replace("\n", "\n  ").toStdString() << std::endl;
+            }
+        });
+        stats_timer.start(stats_interval * 1000);
     }
     
-    std::cout << "SCL pin: " << pin_scl << ", SDA pin: " << pin_sda << std::endl;
-
-    // setup Qt GUI
-    QApplication a(argc, argv);
-    Window window;
-    Serial serial(pin_scl, pin_sda);
-    window.show();
-
-    QObject::connect(window.ui->centralWidget, &canvas::sendPacket, &serial, &Serial::write);
-    QObject::connect(&serial, &Serial::packet_received, window.ui->centralWidget, &canvas::packetReceived);
-
     return a.exec();
 }
@@ -0,0 +1,175 @@
+#ifndef PACKET_RING_HPP
+#define PACKET_RING_HPP
+
+#include <vector>
+#include <cstddef>
+#include <algorithm>
+#include <atomic>
+
+/**
+ * Read-only view of a packet stored elsewhere (e.g. in a 'PacketRing' slot), so it can be looked at without copying.
+ */
+struct packet_view
+{
+    const unsigned char *data = nullptr;
+    std::size_t length = 0;
+    
+    std::size_t size() const { return length; }
+    bool empty() const { return length == 0; }
+    const unsigned char &operator[](std::size_t i) const { return data[i]; }
+    const unsigned char *begin() const { return data; }
+    const unsigned char *end() const { return data + length; }
+};
+
+/**
+ * Empty type for rings which don't need any extra information per packet.
+ */
+struct no_packet_info { };
+
+/**
+ * Fixed-capacity FIFO of packets, with all the entries allocated up front so that queueing and
+ * dequeueing packets never allocates. Each slot holds a packet as it's framed on the wire
+ * (the length, in one or more bytes, followed by the packet bytes) plus some extra information of type 'Info'.
+ * Packets are written into a slot in place with 'reserve' and 'commit', and read in place with 'front' and 'pop'.
+ *
+ * One thread may write packets while another reads them without any locking ('reserve', 'commit' and 'push'
+ * on the writing side, 'front', 'at', 'pop' and 'clear' on the reading side, and 'size' on either).
+ * A committed slot is only visible to the reader once it's completely written, and a slot isn't reused by
+ * the writer until the reader has popped it.
+ */
+template <typename Info = no_packet_info>
+class PacketRing
+{
+public:
+    struct slot
+    {
+        // Number of packet bytes, not counting the length bytes.
+        std::size_t size;
+        
+        // The length bytes (least significant first) followed by the packet bytes.
+        unsigned char *frame;
+        
+        // Number of length bytes at the start of the frame.
+        std::size_t header;
+        
+        Info info;
+        
+        unsigned char *data() const { return frame + header; }
+        
+        // Sets the size of the packet, filling in the length bytes.
+        void set_size(std::size_t n)
+        {
+            size = n;
+            for (std::size_t i = 0; i < header; i++)
+                frame[i] = (n >> (8 * i)) & 0xFF;
+        }
+        
+        packet_view view() const
+        {
+            packet_view v;
+            v.data = data();
+            v.length = size;
+            return v;
+        }
+    };
+    
+    /**
+     * Constructor, specifying the number of entries, the maximum packet size and the number of length bytes.
+     */
+    PacketRing(std::size_t capacity, std::size_t max_size, std::size_t header = 1) :
+        storage(capacity * (max_size + header)), entries(capacity), max_packet(max_size), head(0), tail(0)
+    {
+        for (std::size_t i = 0; i < capacity; i++)
+        {
+            entries[i].frame = &storage[i * (max_size + header)];
+            entries[i].header = header;
+        }
+    }
+    
+    std::size_t capacity() const { return entries.size(); }
+    std::size_t max_size() const { return max_packet; }
+    std::size_t size() const { return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire); }
+    bool empty() const { return size() == 0; }
+    bool full() const { return size() == entries.size(); }
+    
+    /**
+     * Returns the next free slot to be filled in, or null if the ring is full.
+     * The slot isn't part of the queue until 'commit' is called, and calling this
+     * again before then returns the same slot.
+     */
+    slot *reserve()
+    {
+        std::size_t t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) == entries.size())
+            return nullptr;
+        return &entries[t % entries.size()];
+    }
+    
+    /**
+     * Adds the reserved slot to the back of the queue.
+     */
+    void commit()
+    {
+        tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+    
+    /**
+     * Copies a packet into the next free slot and adds it to the queue.
+     * Returns false if the ring is full or the packet is too big.
+     */
+    bool push(const unsigned char *bytes, std::size_t size, const Info &info = Info())
+    {
+        slot *s = reserve();
+        if (!s || size > max_packet)
+            return false;
+        
+        s->set_size(size);
+        std::copy(bytes, bytes + size, s->data());
+        s->info = info;
+        commit();
+        return true;
+    }
+    
+    /**
+     * Returns the i-th slot from the front of the queue. 'i' must be less than 'size()'.
+     */
+    slot &at(std::size_t i)
+    {
+        return entries[(head.load(std::memory_order_relaxed) + i) % entries.size()];
+    }
+    
+    /**
+     * Returns the slot at the front of the queue. The ring must not be empty.
+     */
+    slot &front()
+    {
+        return at(0);
+    }
+    
+    /**
+     * Removes the slot at the front of the queue, freeing it up to be reused.
+     */
+    void pop()
+    {
+        head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+    
+    /**
+     * Removes all the entries from the queue.
+     */
+    void clear()
+    {
+        head.store(tail.load(std::memory_order_acquire), std::memory_order_release);
+    }
+    
+private:
+    std::vector<unsigned char> storage;
+    std::vector<slot> entries;
+    std::size_t max_packet;
+    
+    // Positions of the front and the back of the queue, which only ever count up.
+    // 'head' is only written by the reader and 'tail' only by the writer.
+    std::atomic<std::size_t> head, tail;
+};
+
+#endif /* PACKET_RING_HPP */
@@ -0,0 +1,40 @@
+#include "pin_backend.hpp"
+
+#include <wiringPi.h>
+
+WiringPiBackend::WiringPiBackend()
+{
+    wiringPiSetup();
+}
+
+void WiringPiBackend::set_level(int pin, bool level)
+{
+    if (level)
+    {
+        pullUpDnControl(pin, PUD_UP);
+        pinMode(pin, INPUT);
+    }
+    else
+    {
+        digitalWrite(pin, LOW);
+        pinMode(pin, OUTPUT);
+    }
+}
+
+bool WiringPiBackend::get_level(int pin)
+{
+    return digitalRead(pin);
+}
+
+EdgeSource *WiringPiBackend::edge_source(int pin_a, int pin_b)
+{
+    GpioEdgeSource *edges = new GpioEdgeSource(pin_a, pin_b);
+    
+    if (!edges->valid())
+    {
+        delete edges;
+        return nullptr;
+    }
+    
+    return edges;
+}
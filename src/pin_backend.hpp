@@ -0,0 +1,55 @@
+#ifndef PIN_BACKEND_HPP
+#define PIN_BACKEND_HPP
+
+#include "edge_source.hpp"
+
+/**
+ * Interface through which 'Serial' drives and reads its open-drain pins.
+ * A pin is either released (pulled up, so it reads high unless another device pulls it low) or pulled low.
+ */
+class PinBackend
+{
+public:
+    virtual ~PinBackend() {}
+    
+    /**
+     * Releases the pin if 'level' is true, or pulls it low if false.
+     */
+    virtual void set_level(int pin, bool level) = 0;
+    
+    /**
+     * Returns the current level of the pin.
+     */
+    virtual bool get_level(int pin) = 0;
+    
+    /**
+     * Returns a new source of edge events for the two pins, or null if the backend doesn't support them.
+     * The caller takes ownership of the returned object.
+     */
+    virtual EdgeSource *edge_source(int /* pin_a */, int /* pin_b */) { return nullptr; }
+};
+
+#ifndef NO_WIRINGPI
+/**
+ * Pin backend for the Raspberry Pi GPIO header, using wiringPi pin numbers.
+ * Left out of the targets built with NO_WIRINGPI, which only run on the simulated bus.
+ */
+class WiringPiBackend : public PinBackend
+{
+public:
+    /**
+     * Constructor, sets up wiringPi.
+     */
+    WiringPiBackend();
+    
+    void set_level(int pin, bool level) override;
+    bool get_level(int pin) override;
+    
+    /**
+     * Returns a 'GpioEdgeSource' for the pins, or null if the GPIO character device isn't available.
+     */
+    EdgeSource *edge_source(int pin_a, int pin_b) override;
+};
+#endif
+
+#endif /* PIN_BACKEND_HPP */
@@ -1,18 +1,148 @@
 #include "serial.hpp"
+#include "fnv1a.hpp"
 
-#include <wiringPi.h>
 #include <unistd.h>
+#include <time.h>
 #include <thread>
 #include <chrono>
+#include <algorithm>
 
-#define SET_PIN_LEVEL(pin, level)   if (level) { pullUpDnControl(pin, PUD_UP); pinMode(pin, INPUT); } \
-                                    else       { digitalWrite(pin, LOW); pinMode(pin, OUTPUT); }
-#define GET_PIN_LEVEL(pin)        digitalRead(pin)
+#define SET_PIN_LEVEL(pin, level)   pins->set_level(pin, level)
+#define GET_PIN_LEVEL(pin)          pins->get_level(pin)
 
-Serial::Serial(int pin_scl, int pin_sda) : pin_scl(pin_scl), pin_sda(pin_sda)
+const unsigned char Serial::control_marker;
+const std::size_t Serial::max_packet_size;
+const std::size_t Serial::max_extended_packet_size;
+
+// Types of link control frames, following the control marker byte.
+enum
+{
+    CONTROL_PROBE = 1,      // test pattern sent at a candidate bitrate
+    CONTROL_PROBE_CHECK,    // sent at the base bitrate after a probe, telling receivers what they should have received
+    CONTROL_PROBE_FAIL,     // reply from a node which didn't receive the probe correctly
+    CONTROL_SET_RATE,       // tells all nodes to switch to a new bitrate
+    
+    // Replies to frames with a CRC trailer, identifying the frame by its sender, sequence number and CRC.
+    // A NACK wins arbitration against an ACK sent at the same time, as it's the first to have a 0 bit
+    // (being sent least significant bit first).
+    CONTROL_NACK = 6,       // a corrupted frame was received (with the trailer as it was received)
+    CONTROL_ACK = 7         // a frame was received and stored
+};
+
+// Length of the trailer added to frames when CRCs are used (the sender's id, a sequence number and the CRC).
+// Link control frames are sent with an id and sequence number of 0, so that the same reply from several
+// receivers at once makes up a single frame.
+static const std::size_t crc_trailer_size = 5;
+
+// Number of bytes in ACK and NACK frames (not counting the length or the trailer).
+static const std::size_t ack_frame_size = 7;
+
+// Most senders whose last packet is remembered by a receiver.
+static const std::size_t max_peers = 32;
+
+// Time a sender waits for an ACK or NACK after sending a frame before sending it again, in ACK frames.
+static const int ack_window_frames = 4;
+
+// CRC-16/CCITT-FALSE (polynomial 0x1021, initial value 0xFFFF).
+static uint16_t crc16(const unsigned char *data, std::size_t length)
+{
+    // The table is built once, by whichever engine thread gets here first:
+    static const std::vector<uint16_t> table = [] () {
+        std::vector<uint16_t> table(256);
+        for (int i = 0; i < 256; i++)
+        {
+            uint16_t crc = i << 8;
+            for (int bit = 0; bit < 8; bit++)
+                crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+            table[i] = crc;
+        }
+        return table;
+    }();
+    
+    uint16_t crc = 0xFFFF;
+    for (std::size_t i = 0; i < length; i++)
+        crc = (crc << 8) ^ table[((crc >> 8) ^ data[i]) & 0xFF];
+    return crc;
+}
+
+// Number of clock cycles (at the base bitrate) without any clock edges after which a frame is abandoned.
+static const int watchdog_cycles = 16;
+
+// Most clock cycles a node waits before trying again after a frame was cut short or abandoned.
+static const int restart_max_cycles = 16;
+
+// Half clock cycles between the times nodes start sending packets of successive priorities once the bus is idle,
+// and the extra half cycles waited by a node deferring to the others with fair access.
+static const int priority_slot = 4;
+static const int fairness_slot = 2;
+
+// Returns all the data pins of an instance, the main SDA pin first.
+static std::vector<int> all_data_pins(int pin_sda, const std::vector<int> &extra_pins)
+{
+    std::vector<int> pins(1, pin_sda);
+    pins.insert(pins.end(), extra_pins.begin(), extra_pins.end());
+    return pins;
+}
+
+// Sleeps until the given time, using an absolute deadline so that delays don't add up.
+static void sleep_until(std::chrono::steady_clock::time_point deadline)
+{
+    std::chrono::nanoseconds since_epoch = deadline.time_since_epoch();
+    
+    struct timespec ts;
+    ts.tv_sec = since_epoch.count() / 1000000000;
+    ts.tv_nsec = since_epoch.count() % 1000000000;
+    
+    // std::chrono::steady_clock uses CLOCK_MONOTONIC on Linux:
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0);
+}
+
+#ifndef NO_WIRINGPI
+Serial::Serial(int pin_scl, int pin_sda, const options &opts) : Serial(new WiringPiBackend(), pin_scl, pin_sda, opts) { }
+#endif
+
+Serial::Serial(PinBackend *pins, int pin_scl, int pin_sda, const options &opts) :
+    pin_scl(pin_scl), pin_sda(pin_sda), opts(opts),
+    data_pins(all_data_pins(pin_sda, opts.extra_data_pins)), data_lines(data_pins.size()),
+    packet_max(opts.extended_length ? std::max(max_packet_size, std::min(opts.extended_max_packet, max_extended_packet_size)) : max_packet_size),
+    frame_prefix(opts.priorities ? 1 : 0), frame_header(opts.extended_length ? 2 : 1), frame_trailer(opts.crc ? crc_trailer_size : 0),
+    node_id(std::random_device()() & 0xFFFF), bus_rate(opts.bitrate), tx_rate(opts.bitrate),
+    tx_buffer(opts.buffer_packets, packet_max + frame_trailer, frame_header),
+    rx_buffer(opts.buffer_packets, packet_max + frame_trailer, frame_header),
+    control_buffer(8, max_packet_size + frame_trailer, frame_header),
+    rx_scratch_frame(frame_header + packet_max + frame_trailer), pins(pins)
 {
-    wiringPiSetup();
+    rx_scratch.frame = rx_scratch_frame.data();
+    rx_scratch.header = frame_header;
+    rx_slot = &rx_scratch;
+    restart_random.seed(std::random_device()());
+    peers.reserve(max_peers);
+    
+    // An instance which can't work is left stopped, with no threads and the pins as they were:
+    if (!check_options(pin_scl, pin_sda, opts).empty())
+    {
+        finish = true;
+        is_stopped = true;
+        return;
+    }
+    is_valid = true;
+    
+    if (opts.edge_events)
+        edges.reset(pins->edge_source(pin_scl, pin_sda));
+    
+    // Release all the pins before any thread can start a transmission:
+    release_data();
+    SET_PIN_LEVEL(pin_scl, 1);
+    
+    level_sda = GET_PIN_LEVEL(pin_sda);
+    level_scl = GET_PIN_LEVEL(pin_scl);
+    idle_time = std::chrono::steady_clock::now();
+    
     pin_thread();
+    engine_thread();
+    
+    if (opts.probe_bitrate > opts.bitrate)
+        probe_thread();
 }
 
 Serial::~Serial()
@@ -20,13 +150,40 @@ Serial::~Serial()
     stop();
 }
 
+std::string Serial::check_options(int pin_scl, int pin_sda, const options &opts)
+{
+    // Each clock pulse moves a bit on every data line, so the lines have to divide a byte evenly:
+    const std::vector<int> &extra_pins = opts.extra_data_pins;
+    if (8 % (1 + extra_pins.size()) != 0)
+        return "There must be 1, 3 or 7 extra data pins.";
+    
+    if (pin_scl == pin_sda)
+        return "SCL and SDA pins cannot be the same.";
+    for (int pin : extra_pins)
+    {
+        if (pin == pin_scl || pin == pin_sda || std::count(extra_pins.begin(), extra_pins.end(), pin) > 1)
+            return "The data pins must all be different, and different from the SCL pin.";
+    }
+    
+    if (opts.bitrate <= 0)
+        return "Bitrate must be positive.";
+    return "";
+}
+
+bool Serial::valid() const
+{
+    return is_valid;
+}
+
+// The receive buffer is handed from the pin thread to the reading thread without locking 'mtx',
+// so reading packets never holds up the pins.
 Serial::packet Serial::read()
 {
     packet p(0);
-    std::lock_guard<std::mutex> lock(mtx);
-    if (rx_buffer.size())
+    if (!rx_empty())
     {
-        p = rx_buffer.front();
+        packet_view v = rx_buffer.front().view();
+        p.assign(v.begin(), v.end());
         rx_buffer.pop();
     }
     return p;
@@ -35,40 +192,241 @@ Serial::packet Serial::read()
 Serial::packet Serial::peek()
 {
     packet p(0);
-    std::lock_guard<std::mutex> lock(mtx);
-    if (rx_buffer.size())
+    if (!rx_empty())
     {
-        p = rx_buffer.front();
+        packet_view v = rx_buffer.front().view();
+        p.assign(v.begin(), v.end());
     }
     return p;
 }
 
-bool Serial::write(packet bytes)
+Serial::packet_view Serial::peek_view()
+{
+    if (!rx_empty())
+        return rx_buffer.front().view();
+    return packet_view();
+}
+
+void Serial::release()
 {
-    // Check that the packet size is valid:
-    if (0 < bytes.size() && bytes.size() <= 256)
+    if (rx_buffer.size())
+        rx_buffer.pop();
+}
+
+bool Serial::rx_empty()
+{
+    if (rx_buffer.size())
+        return false;
+    
+    // The reader has caught up, so the next packet should be signalled again. The buffer has
+    // to be checked again after clearing the flag, in case a packet was committed in between
+    // (while the flag was still set, so no signal was emitted for it):
+    notify_pending.store(false);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    return rx_buffer.size() == 0;
+}
+
+bool Serial::write(const packet &bytes)
+{
+    unsigned char *slot = begin_write();
+    if (!slot)
+        return false;
+    
+    std::copy(bytes.begin(), bytes.begin() + std::min(bytes.size(), packet_max), slot);
+    return end_write(bytes.size());
+}
+
+bool Serial::write_keyed(const packet &bytes, uint32_t key)
+{
+    unsigned char *slot = begin_write();
+    if (!slot)
+        return false;
+    
+    std::copy(bytes.begin(), bytes.begin() + std::min(bytes.size(), packet_max), slot);
+    return end_write(bytes.size(), key);
+}
+
+bool Serial::replace(const packet &bytes, uint32_t key, int priority)
+{
+    unsigned char *slot = begin_write();
+    if (!slot || key == 0)
+        return false;
+    
+    std::copy(bytes.begin(), bytes.begin() + std::min(bytes.size(), packet_max), slot);
+    return commit_write(bytes.size(), key, priority, true);
+}
+
+bool Serial::write_prioritized(const packet &bytes, int priority, uint32_t key)
+{
+    unsigned char *slot = begin_write();
+    if (!slot)
+        return false;
+    
+    std::copy(bytes.begin(), bytes.begin() + std::min(bytes.size(), packet_max), slot);
+    return end_write(bytes.size(), key, priority);
+}
+
+std::size_t Serial::cancel_pending()
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    
+    // Mark the packets as cancelled, as they can't be taken out of the middle of the buffer.
+    // They're skipped (and freed up) when they get to the front:
+    std::size_t count = 0;
+    for (std::size_t i = first_pending(); i < tx_buffer.size(); i++)
     {
-        std::lock_guard<std::mutex> lock(mtx);
-        tx_buffer.push(bytes);
-        trigger_tx();
-        return true;
+        tx_slot &slot = tx_buffer.at(i);
+        if (!slot.info.cancelled)
+        {
+            slot.info.cancelled = true;
+            tx_cancelled++;
+            bytes_saved += frame_size(slot.size);
+            count++;
+        }
     }
-    else
+    
+    trigger_tx(std::chrono::steady_clock::now());
+    return count;
+}
+
+unsigned char *Serial::begin_write()
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    
+    // The reserved slot isn't touched by the other threads until it's committed:
+    tx_slot *slot = tx_buffer.reserve();
+    return slot ? slot->data() : nullptr;
+}
+
+bool Serial::end_write(std::size_t size, uint32_t key, int priority)
+{
+    return commit_write(size, key, priority, false);
+}
+
+bool Serial::commit_write(std::size_t size, uint32_t key, int priority, bool replace_only)
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    
+    tx_slot *slot = tx_buffer.reserve();
+    
+    // Check that the packet size is valid, and that it isn't a control frame:
+    if (!slot || size == 0 || size > packet_max || slot->data()[0] == control_marker)
+        return false;
+    
+    // If a packet with the same key is still waiting, the new packet takes its place in the buffer:
+    tx_slot *queued = nullptr;
+    if (key != 0)
     {
+        for (std::size_t i = first_pending(); i < tx_buffer.size() && !queued; i++)
+        {
+            if (tx_buffer.at(i).info.key == key && !tx_buffer.at(i).info.cancelled)
+                queued = &tx_buffer.at(i);
+        }
+    }
+    if (replace_only && !queued)
         return false;
+    
+    slot->set_size(size);
+    if (frame_trailer)
+        add_trailer(*slot, node_id, tx_seq++);
+    
+    uint32_t trace_id = 0;
+    if (trace_hook)
+    {
+        trace_id = fnv1a(slot->data(), size);
+        trace_hook("write", trace_id);
+    }
+    
+    // Swapping the frames leaves the old one in the free slot, ready to be reused:
+    if (queued)
+    {
+        bytes_saved += frame_size(queued->size);
+        std::swap(queued->frame, slot->frame);
+        std::swap(queued->size, slot->size);
+        queued->info.trace_id = trace_id;
+        queued->info.priority = priority;
+        return true;
     }
+    
+    slot->info = tx_info();
+    slot->info.key = key;
+    slot->info.priority = priority;
+    slot->info.queued = std::chrono::steady_clock::now();
+    slot->info.trace_id = trace_id;
+    tx_buffer.commit();
+    counters.tx_depth_max = std::max(counters.tx_depth_max, tx_buffer.size() - tx_cancelled);
+    trigger_tx(std::chrono::steady_clock::now());
+    return true;
 }
 
 std::size_t Serial::available()
 {
-    std::lock_guard<std::mutex> lock(mtx);
     return rx_buffer.size();
 }
 
 std::size_t Serial::remaining()
 {
     std::lock_guard<std::mutex> lock(mtx);
-    return tx_buffer.size();
+    return tx_buffer.size() - tx_cancelled;
+}
+
+std::size_t Serial::packet_limit()
+{
+    return packet_max;
+}
+
+uint64_t Serial::retransmitted()
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    return retransmissions;
+}
+
+Serial::stats Serial::statistics()
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    
+    // Measure the bitrate again once the last measurement is a second old:
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    std::chrono::duration<double> elapsed = now - rate_mark_time;
+    if (elapsed >= std::chrono::seconds(1))
+    {
+        if (rate_mark_time != std::chrono::steady_clock::time_point())
+            counters.bits_per_second = (counters.bits - rate_mark_bits) / elapsed.count();
+        rate_mark_bits = counters.bits;
+        rate_mark_time = now;
+    }
+    
+    stats copy = counters;
+    copy.retransmissions = retransmissions;
+    copy.bytes_saved = bytes_saved;
+    copy.tx_depth = tx_buffer.size() - tx_cancelled;
+    copy.rx_depth = rx_buffer.size();
+    copy.max_edge_latency = std::chrono::duration_cast<std::chrono::microseconds>(max_latency).count();
+    return copy;
+}
+
+void Serial::set_trace_hook(std::function<void(const char *stage, uint32_t packet_id)> hook)
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    trace_hook = hook;
+}
+
+uint64_t Serial::saved_bytes()
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    return bytes_saved;
+}
+
+std::size_t Serial::first_pending()
+{
+    // The packet at the front is being sent if a transmission of a packet (rather than a control frame) is going on,
+    // and it's also still in use while waiting for it to be acknowledged:
+    return (state == TX && !tx_control) || awaiting_ack ? 1 : 0;
+}
+
+std::size_t Serial::frame_size(std::size_t size)
+{
+    return frame_prefix + frame_header + size + frame_trailer;
 }
 
 std::size_t Serial::wait_available(long timeout_micros)
@@ -79,10 +437,12 @@ std::size_t Serial::wait_available(long timeout_micros)
         return rx_buffer.size();
     
     // Wait for packet to be received:
+    available_waiters++;
     if (timeout_micros >= 0)
         available_condition.wait_for(mtx, std::chrono::microseconds(timeout_micros));
     else
         available_condition.wait(mtx);
+    available_waiters--;
     
     return rx_buffer.size();
 }
@@ -97,6 +457,10 @@ void Serial::stop()
     // Allow any calls to 'wait_available' to return:
     available_condition.notify_all();
     
+    // Wake up the engine and probe threads so they can see the finish flag:
+    timer_condition.notify_all();
+    probe_condition.notify_all();
+    
     // Wait for all threads to finish (count == 0):
     stop_condition.wait(mtx, [this]{ return thread_count == 0; });
     
@@ -109,6 +473,23 @@ bool Serial::stopped()
     return is_stopped;
 }
 
+int Serial::bitrate()
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    return bus_rate;
+}
+
+bool Serial::edge_events()
+{
+    return edges != nullptr;
+}
+
+long Serial::max_edge_latency()
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    return std::chrono::duration_cast<std::chrono::microseconds>(max_latency).count();
+}
+
 void Serial::pin_thread()
 {
     mtx.lock();
@@ -122,11 +503,13 @@ void Serial::pin_thread()
         
         mtx.lock();
         
-        SET_PIN_LEVEL(pin_sda, 1);
-        SET_PIN_LEVEL(pin_scl, 1);
+        bool last_state_sda = level_sda;
+        bool last_state_scl = level_scl;
         
-        bool last_state_sda = GET_PIN_LEVEL(pin_sda);
-        bool last_state_scl = GET_PIN_LEVEL(pin_scl);
+        // Sample fast enough for the highest bitrate that could be used on the bus:
+        int poll_rate = std::max(opts.bitrate, opts.probe_bitrate);
+        std::chrono::nanoseconds poll_period(1000000000 / poll_rate / 8);
+        std::chrono::steady_clock::time_point next_poll = std::chrono::steady_clock::now();
         
         mtx.unlock();
         
@@ -137,9 +520,28 @@ void Serial::pin_thread()
             if (finish && state == IDLE)
                 break;
             
+            if (edges)
+            {
+                mtx.unlock();
+                
+                // Block until the kernel reports an edge, waking up regularly to check the finish flag:
+                EdgeSource::edge e;
+                if (edges->wait_edge(e, 100000))
+                {
+                    mtx.lock();
+                    dispatch(e);
+                    mtx.unlock();
+                }
+                continue;
+            }
+            
             bool curr_state_sda = GET_PIN_LEVEL(pin_sda);
             bool curr_state_scl = GET_PIN_LEVEL(pin_scl);
             
+            level_sda = curr_state_sda;
+            level_scl = curr_state_scl;
+            edge_time = std::chrono::steady_clock::now();
+            
             if (!last_state_sda && curr_state_sda) isr_sda_rise();
             if (last_state_sda && !curr_state_sda) isr_sda_fall();
             if (!last_state_scl && curr_state_scl) isr_scl_rise();
@@ -150,7 +552,78 @@ void Serial::pin_thread()
             last_state_sda = curr_state_sda;
             last_state_scl = curr_state_scl;
             
-            usleep(1000000 / Serial::bitrate / 8);
+            // Poll on a fixed schedule, skipping ahead if we've fallen behind:
+            next_poll += poll_period;
+            if (next_poll < std::chrono::steady_clock::now())
+                next_poll = std::chrono::steady_clock::now();
+            sleep_until(next_poll);
+        }
+        
+        thread_count--;
+        stop_condition.notify_all();
+        mtx.unlock();
+    });
+    
+    thr.detach();
+}
+
+void Serial::dispatch(const EdgeSource::edge &e)
+{
+    std::chrono::steady_clock::duration latency = std::chrono::steady_clock::now() - e.timestamp;
+    if (latency > max_latency)
+        max_latency = latency;
+    
+    edge_time = e.timestamp;
+    
+    if (e.pin == pin_sda)
+    {
+        level_sda = e.rising;
+        e.rising ? isr_sda_rise() : isr_sda_fall();
+    }
+    else if (e.pin == pin_scl)
+    {
+        level_scl = e.rising;
+        e.rising ? isr_scl_rise() : isr_scl_fall();
+    }
+}
+
+void Serial::engine_thread()
+{
+    mtx.lock();
+    thread_count++;
+    mtx.unlock();
+    
+    std::thread thr([this] () {
+        // Set this thread to "realtime" high priority:
+        struct sched_param param { .sched_priority = 55 };
+        sched_setscheduler(0, SCHED_RR, &param);
+        
+        mtx.lock();
+        
+        while (true)
+        {
+            // Pending transmission triggers are dropped once finished, but an
+            // ongoing transmission still needs its clock pulses:
+            if (finish && state == IDLE)
+                break;
+            
+            if (timer_queue.empty())
+            {
+                timer_condition.wait(mtx);
+                continue;
+            }
+            
+            // Sleep until the earliest deadline (as an absolute CLOCK_MONOTONIC time), or until an earlier event is scheduled:
+            std::chrono::steady_clock::time_point deadline = timer_queue.top().deadline;
+            if (std::chrono::steady_clock::now() < deadline)
+            {
+                timer_condition.wait_until(mtx, deadline);
+                continue;
+            }
+            
+            std::function<void()> action = timer_queue.top().action;
+            timer_queue.pop();
+            action();
         }
         
         thread_count--;
@@ -163,28 +636,38 @@ void Serial::pin_thread()
 
 void Serial::isr_scl_rise()
 {
-    bool rx_bit_val = GET_PIN_LEVEL(pin_sda);
+    // The first data line's level is the one as of the clock edge. Any others are read now, which is fine
+    // as long as the edge is handled before the clock falls again (they only change while the clock is low):
+    unsigned char rx_bits = level_sda;
+    for (unsigned int line = 1; line < data_lines; line++)
+        rx_bits |= GET_PIN_LEVEL(data_pins[line]) << line;
+    
+    activity_time = edge_time;
+    counters.bits += data_lines;
     
     if (state == TX)
     {
         // Check if last byte has been transmitted:
-        if (byte_pos > tx_buffer.front().size())
+        if (byte_pos >= frame_header + tx_size)
         {
             // If so, generate a stop condition and return:
             SET_PIN_LEVEL(pin_sda, 1);
             return;
         }
         
-        // Check if the actual pin level is what we transmitted:
-        if (rx_bit_val != tx_bit_val)
+        // Check if the actual pin levels are what we transmitted:
+        if (rx_bits != tx_bits)
         {
-            // If not, arbitartion was lost, switch to RX mode:
+            // If not, arbitartion was lost, switch to RX mode. Any lines still pulled low are released, which never
+            // changes the bits of the node that won (if any did), as it pulled low at least the same lines:
             state = RX;
+            counters.arbitration_lost++;
+            release_data();
         }
         else
         {
             // If so, generate the next clock pulse:
-            clock_pulse();
+            clock_pulse(edge_time);
         }
     }
     
@@ -192,135 +675,457 @@ void Serial::isr_scl_rise()
     // If in TX mode, arbitration could force the device into RX mode
     // and we don't want to miss all the data beforehand.
     
-    // Add bit to byte:
-    rx_byte |= rx_bit_val << (bit_pos);
-    bit_pos++;
+    // Add bits to byte:
+    rx_byte |= rx_bits << bit_pos;
+    bit_pos += data_lines;
     
     // If byte is filled, add byte to packet and start new byte:
     if (bit_pos == 8)
     {
-        // Ignore first byte (length byte).
-        if (byte_pos > 0)
-            rx_packet.push_back(rx_byte);
+        if (prefix_left)
+        {
+            // The priority byte only matters for arbitration:
+            prefix_left--;
+        }
+        else
+        {
+            // Read the length from the length bytes, dropping frames too long for a slot. Anything after the end of the
+            // frame is ignored (with 8 data lines, the clock pulse setting up the stop condition fills a whole byte).
+            // Packets are never empty, so a single length byte of 0 stands for a packet of 256 bytes:
+            if (byte_pos < frame_header)
+            {
+                rx_length |= (std::size_t) rx_byte << (8 * byte_pos);
+                if (byte_pos == frame_header - 1 && rx_length == 0 && frame_header == 1)
+                    rx_length = 256;
+                if (byte_pos == frame_header - 1 && rx_length > packet_max)
+                    rx_dropped = true;
+            }
+            else if (!rx_dropped && byte_pos < frame_header + rx_length + frame_trailer)
+            {
+                rx_slot->frame[byte_pos] = rx_byte;
+                rx_slot->size = byte_pos - frame_header + 1;
+                rx_sum = fnv1a(rx_sum, rx_byte);
+            }
+            byte_pos++;
+        }
         
         bit_pos = 0;
-        byte_pos++;
         rx_byte = 0;
     }
 }
 
 void Serial::isr_scl_fall()
 {
-    // If TX mode, write next bit to SDA:
+    activity_time = edge_time;
+    
+    // If TX mode, write the next bit to each data line:
     if (state == TX)
     {
-        packet &tx_packet = tx_buffer.front();
-        unsigned char tx_byte;
-        
-        if (byte_pos == 0)
-            tx_byte = tx_packet.size(); // first byte is the length byte.
-        else if (byte_pos > tx_packet.size())
-            tx_byte = 0; // after last byte, set up the stop bit by setting SDA low
+        if (byte_pos >= frame_header + tx_size)
+            tx_bits = ~1; // after last byte, set up the stop bit by setting SDA low (releasing any other lines)
+        else if (prefix_left)
+            tx_bits = tx_priority >> bit_pos; // else get the priority byte (if any)
         else
-            tx_byte = tx_packet.at(byte_pos - 1); // else get the data byte
+            tx_bits = tx_frame[byte_pos] >> bit_pos; // else get the length bytes or data byte
         
-        tx_bit_val = tx_byte & (1 << bit_pos);
+        tx_bits &= (1u << data_lines) - 1;
+        for (unsigned int line = 0; line < data_lines; line++)
+            SET_PIN_LEVEL(data_pins[line], (tx_bits >> line) & 1);
         
-        SET_PIN_LEVEL(pin_sda, tx_bit_val);
+        // Finish the clock pulse once SDA is set up. SCL stays low for at least half a cycle,
+        // even if this edge was handled late, so that the receivers see a proper bit:
+        std::chrono::steady_clock::time_point rise = std::max(clock_from + 2 * half_period(tx_rate), edge_time + half_period(tx_rate));
+        schedule(rise, [this] () {
+            SET_PIN_LEVEL(pin_scl, 1);
+        });
     }
 }
 
 void Serial::isr_sda_rise()
 {
     // Check if SCL is high -> stop condition:
-    if (GET_PIN_LEVEL(pin_scl))
+    if (level_scl)
     {
+        last_rx_sum = rx_sum;
+        
+        // A frame is complete if it stops one clock pulse after the end of its trailer. Otherwise it was cut short,
+        // e.g. when none of the senders on a bus with several data lines won arbitration (each seeing another pulling
+        // down a different line). The senders then wait a random time before trying again, so that they don't keep
+        // colliding the same way:
+        bool complete = 8 * byte_pos + bit_pos == 8 * (frame_header + rx_length + frame_trailer) + data_lines;
+        bool cut_short = false;
+        
         if (state == RX)
         {
-            rx_buffer.push(rx_packet);
-            available_condition.notify_all();
-            emit packet_received(this);
+            cut_short = !rx_dropped && !complete && (byte_pos || bit_pos);
+            bool intact = !rx_dropped && complete && rx_slot->size > 0;
+            uint16_t rx_sender = 0;
+            unsigned char rx_seq = 0;
+            uint16_t rx_crc = 0;
+            
+            // Check and strip the CRC trailer. Corrupted frames are NACKed so that the sender sends them again right away,
+            // unless they could have been ACKs or NACKs themselves (which would lead to NACKs being sent back and forth
+            // on a noisy bus). Packets that short are sent again when they aren't acknowledged instead. The NACK carries
+            // the trailer as received, so the sender only acts on it if it's about the frame it just sent:
+            if (intact && frame_trailer)
+            {
+                bool nackable = rx_slot->size > ack_frame_size + frame_trailer;
+                intact = check_trailer(*rx_slot, rx_sender, rx_seq, rx_crc);
+                
+                if (intact)
+                    last_rx_sum = fnv1a(rx_slot->data(), rx_slot->size);
+                else if (nackable)
+                    write_control(ack_frame(CONTROL_NACK, rx_sender, rx_seq, rx_crc), bus_rate);
+            }
+            
+            packet_view rx_packet = rx_slot->view();
+            
+            if (!intact || rx_packet.empty())
+            {
+                // Nothing received, or the frame was too long, cut short or corrupted, nothing to do.
+                if (rx_dropped || cut_short || rx_slot->size > 0)
+                    counters.frames_dropped++;
+            }
+            else if (rx_packet[0] == control_marker)
+            {
+                handle_control(rx_packet);
+            }
+            else if (frame_trailer && duplicate(rx_sender, rx_seq, rx_crc))
+            {
+                // Sent again because the ACK was missed, so it only needs acknowledging again:
+                write_control(ack_frame(CONTROL_ACK, rx_sender, rx_seq, rx_crc), bus_rate);
+            }
+            else if (rx_slot == &rx_scratch)
+            {
+                // The receive buffer was full:
+                counters.frames_dropped++;
+            }
+            else
+            {
+                // Only acknowledge frames which could be stored, so that the sender tries again later otherwise:
+                if (frame_trailer)
+                {
+                    write_control(ack_frame(CONTROL_ACK, rx_sender, rx_seq, rx_crc), bus_rate);
+                    remember(rx_sender, rx_seq, rx_crc);
+                }
+                
+                rx_buffer.commit();
+                counters.frames_received++;
+                
+                // The checksum kept of the frame is the same hash the sender traced it with:
+                if (trace_hook)
+                    trace_hook("frame received", last_rx_sum);
+                
+                if (available_waiters)
+                    available_condition.notify_all();
+                
+                // Only signal the first packet of a batch, the rest are picked up by the
+                // reader as it empties the buffer:
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                if (!notify_pending.exchange(true))
+                    emit packet_received(this);
+            }
+            
+            rx_slot = &rx_scratch;
         }
         else if (state == TX)
         {
-            tx_buffer.pop();
+            counters.frames_sent++;
+            
+            if (trace_hook && !tx_control)
+                trace_hook("tx stop", tx_buffer.front().info.trace_id);
+            
+            if (tx_control)
+            {
+                control_buffer.pop();
+                probe_condition.notify_all();
+            }
+            else if (frame_trailer)
+            {
+                // Keep the packet until the receivers have had time to acknowledge it. A stale
+                // timer (from an earlier packet) is recognised by its generation number:
+                awaiting_ack = true;
+                ack_received = false;
+                nack_received = false;
+                
+                unsigned int generation = ++ack_generation;
+                int ack_bits = 8 * (frame_prefix + frame_header + ack_frame_size + frame_trailer + 1); // ACK frame, plus start and stop conditions
+                std::chrono::steady_clock::duration window = ack_window_frames * ack_bits / data_lines * 2 * half_period(bus_rate);
+                schedule(edge_time + window, [this, generation] () {
+                    if (generation == ack_generation)
+                        finish_ack();
+                });
+            }
+            else
+            {
+                tx_buffer.pop();
+            }
+            
+            // Let the nodes which lost arbitration go first:
+            if (opts.fair_access && !tx_control)
+                fair_defer = true;
         }
         
         state = IDLE;
         
         // Trigger the next transmission:
-        trigger_tx();
+        idle_time = cut_short ? edge_time + restart_delay() : edge_time;
+        trigger_tx(idle_time);
     }
 }
 
 void Serial::isr_sda_fall()
 {
     // Check if SCL is high -> start condition:
-    if (GET_PIN_LEVEL(pin_scl))
+    if (level_scl)
     {
         bit_pos = 0;
         rx_byte = 0;
         byte_pos = 0;
-        rx_packet = packet();
+        prefix_left = frame_prefix;
+        rx_length = 0;
+        rx_sum = fnv1a_basis;
+        
+        // Receive straight into the receive buffer, or drop the frame if it's full:
+        rx_slot = rx_buffer.reserve();
+        if (!rx_slot)
+            rx_slot = &rx_scratch;
+        rx_slot->size = 0;
+        rx_dropped = false;
         
         if (state == IDLE)
         {
             state = RX;
         }
+        
+        activity_time = edge_time;
+        watchdog();
     }
 }
 
-// Asynchronously waits for half a clock cycle and then starts a new transmission if it can.
-void Serial::trigger_tx()
+// Waits for half a clock cycle (on the engine thread) and then starts a new transmission if it can.
+// Less urgent packets wait longer (see 'options::priorities'), and so does a node deferring to the others
+// (see 'options::fair_access'), so that the nodes with more urgent packets or which aren't deferring start first.
+// Link control frames wait half a cycle at the fastest rate any node could be using, so that a node still on a slower
+// rate than the others (e.g. while they settle on one after probing) isn't kept off the bus by their packets.
+void Serial::trigger_tx(std::chrono::steady_clock::time_point from)
 {
     if (is_stopped)
         return;
     
-    thread_count++;
+    int wait = 1;
+    int wait_rate = bus_rate;
+    if (control_buffer.empty())
+    {
+        // The wait is set by the first packet which will actually be sent, as the cancelled ones are skipped:
+        int level = priority_interactive;
+        if (opts.priorities)
+            for (std::size_t i = 0; i < tx_buffer.size(); i++)
+                if (!tx_buffer.at(i).info.cancelled)
+                {
+                    level = tx_buffer.at(i).info.priority;
+                    break;
+                }
+        wait += priority_slot * (level - priority_interactive) + (fair_defer ? fairness_slot : 0);
+    }
+    else
+    {
+        wait_rate = std::max(bus_rate, opts.probe_bitrate);
+    }
     
-    std::thread thr([this] () {
-        // Delay for half a clock cycle:
-        usleep(1000000 / Serial::bitrate / 2);
-        
-        mtx.lock();
-        
-        // Check the finish flag and that the state is IDLE:
-        if (!finish && state == IDLE)
+    // The waits are timed from the bus going idle, so that a node which deferred (or has less urgent packets) is still
+    // behind the others when their packets are written some time after that:
+    std::chrono::steady_clock::time_point idle = idle_time;
+    schedule(std::max(from, idle + wait * half_period(wait_rate)), [this, idle] () {
+        // Check the finish flag and that the state is IDLE. If the bus has been busy since, the transmission was
+        // triggered again when it went idle:
+        if (!finish && state == IDLE && idle == idle_time)
         {
-            // If there's a packet to transmit, start a new transmission:
-            if (tx_buffer.size())
+            // Free up any cancelled packets at the front of the buffer:
+            while (tx_buffer.size() && tx_buffer.front().info.cancelled)
             {
+                tx_buffer.pop();
+                tx_cancelled--;
+            }
+            
+            // No node which isn't deferring has taken the bus, so this node doesn't need to defer any more:
+            fair_defer = false;
+            
+            // If there's a frame to transmit, start a new transmission.
+            // Control frames go first, and are sent at their own bitrate. Packets wait while the last one is still
+            // waiting to be acknowledged, and nothing starts unless all the lines are released (another node may
+            // have started a frame whose edges haven't been seen yet):
+            if ((control_buffer.size() || (tx_buffer.size() && !awaiting_ack)) && data_released() && GET_PIN_LEVEL(pin_scl))
+            {
+                tx_control = control_buffer.size();
+                
+                // The frame is read straight from its slot, which stays at the front until it's sent:
+                if (tx_control)
+                {
+                    tx_frame = control_buffer.front().frame;
+                    tx_size = control_buffer.front().size + frame_trailer;
+                    tx_rate = control_buffer.front().info;
+                    tx_priority = priority_byte(0);
+                }
+                else
+                {
+                    tx_frame = tx_buffer.front().frame;
+                    tx_size = tx_buffer.front().size + frame_trailer;
+                    tx_rate = bus_rate;
+                    tx_priority = priority_byte(tx_buffer.front().info.priority);
+                    
+                    // Only the first attempt at sending the packet counts towards its queueing delay:
+                    tx_info &info = tx_buffer.front().info;
+                    if (info.queued != std::chrono::steady_clock::time_point())
+                    {
+                        counters.queue_delay.add(std::chrono::duration_cast<std::chrono::microseconds>(
+                            std::chrono::steady_clock::now() - info.queued).count());
+                        info.queued = std::chrono::steady_clock::time_point();
+                    }
+                    
+                    if (trace_hook)
+                        trace_hook("tx start", info.trace_id);
+                }
+                
                 SET_PIN_LEVEL(pin_sda, 0); // start condition
                 state = TX;
-                clock_pulse();
+                tx_generation++;
+                activity_time = std::chrono::steady_clock::now();
+                clock_pulse(activity_time);
+                
+                // A lost start condition means no edges come back, so the transmitter needs its own watchdog:
+                watchdog();
             }
         }
+    });
+}
+
+// Starts a single clock pulse on the engine thread by setting SCL low. The pulse is finished by 'isr_scl_fall'.
+void Serial::clock_pulse(std::chrono::steady_clock::time_point from)
+{
+    clock_from = from;
+    
+    unsigned int generation = tx_generation;
+    schedule(from + half_period(tx_rate), [this, generation] () {
+        if (generation == tx_generation)
+            SET_PIN_LEVEL(pin_scl, 0);
+    });
+}
+
+void Serial::watchdog()
+{
+    watchdog_check(++watchdog_generation);
+}
+
+void Serial::watchdog_check(unsigned int generation)
+{
+    // The timeout is worked out again when the check runs rather than captured, as std::function only keeps
+    // a couple of words without allocating (and this runs for every frame):
+    schedule(activity_time + 2 * watchdog_cycles * half_period(opts.bitrate), [this, generation] () {
+        // Nothing to do once the frame's over, or if a later frame has started a watchdog of its own:
+        if (state == IDLE || generation != watchdog_generation)
+            return;
+        
+        if (std::chrono::steady_clock::now() - activity_time < 2 * watchdog_cycles * half_period(opts.bitrate))
+        {
+            // The bus is still moving, check again later:
+            watchdog_check(generation);
+            return;
+        }
         
-        thread_count--;
-        stop_condition.notify_all();
-        mtx.unlock();
+        // Abandon the frame, release the bus and start again (a transmitted frame stays queued).
+        // The nodes which gave up together start again at different times:
+        release_data();
+        SET_PIN_LEVEL(pin_scl, 1);
+        state = IDLE;
+        tx_generation++;
+        idle_time = std::chrono::steady_clock::now() + restart_delay();
+        trigger_tx(idle_time);
     });
+}
+
+void Serial::release_data()
+{
+    for (int pin : data_pins)
+        SET_PIN_LEVEL(pin, 1);
+}
+
+bool Serial::data_released()
+{
+    for (int pin : data_pins)
+        if (!GET_PIN_LEVEL(pin))
+            return false;
+    return true;
+}
+
+std::chrono::nanoseconds Serial::restart_delay()
+{
+    return (int) (restart_random() % restart_max_cycles) * 2 * half_period(bus_rate);
+}
+
+void Serial::schedule(std::chrono::steady_clock::time_point deadline, std::function<void()> action)
+{
+    timer_event event;
+    event.deadline = deadline;
+    event.action = action;
     
-    thr.detach();
+    timer_queue.push(event);
+    timer_condition.notify_all();
+}
+
+std::chrono::nanoseconds Serial::half_period(int rate)
+{
+    return std::chrono::nanoseconds(1000000000 / rate / 2);
 }
 
-// Asynchronously generates a single clock pulse: SCL low and then high.
-void Serial::clock_pulse()
+void Serial::probe_thread()
 {
+    mtx.lock();
     thread_count++;
+    mtx.unlock();
     
-    // Set SCL low and then high with the appropriate delays, in a separate thread:
     std::thread thr([this] () {
-        usleep(1000000 / Serial::bitrate / 2);
-        
         mtx.lock();
-        SET_PIN_LEVEL(pin_scl, 0);
-        mtx.unlock();
         
-        usleep(1000000 / Serial::bitrate / 2);
+        int good_rate = opts.bitrate;
         
-        mtx.lock();
-        SET_PIN_LEVEL(pin_scl, 1);
+        // Double the rate at each step, up to the maximum:
+        while (!finish && good_rate < opts.probe_bitrate)
+        {
+            int rate = std::min(good_rate * 2, opts.probe_bitrate);
+            probing_rate = rate;
+            probe_failed = false;
+            
+            // Send the probe at the new rate, followed by the check at the base rate which
+            // tells the receivers what they should have received:
+            write_control(probe_frame(rate), rate);
+            write_control(rate_frame(CONTROL_PROBE_CHECK, rate), opts.bitrate);
+            
+            // Wait for both to be sent (which fails if the probe keeps getting corrupted), then give the
+            // receivers time to report any errors. Timeouts are counted in 8-byte frames at the base rate:
+            std::chrono::steady_clock::duration frame_time = 2 * 8 * 8 * half_period(opts.bitrate);
+            bool sent = probe_condition.wait_for(mtx, 32 * frame_time, [this] {
+                return finish || control_buffer.empty();
+            });
+            probe_condition.wait_for(mtx, 4 * frame_time, [this] { return finish || probe_failed; });
+            
+            if (!sent || probe_failed)
+            {
+                control_buffer.clear();
+                break;
+            }
+            
+            good_rate = rate;
+        }
+        
+        probing_rate = 0;
+        
+        // Other nodes may be probing too, and may have settled on a lower rate already:
+        if (!finish)
+        {
+            write_control(rate_frame(CONTROL_SET_RATE, good_rate), opts.bitrate);
+            settle_rate(good_rate);
+        }
         
         thread_count--;
         stop_condition.notify_all();
@@ -329,3 +1134,231 @@ void Serial::clock_pulse()
     
     thr.detach();
 }
+
+Serial::packet Serial::probe_frame(int rate)
+{
+    packet bytes = rate_frame(CONTROL_PROBE, rate);
+    
+    // Pseudo-random test pattern, seeded by the rate:
+    uint32_t x = rate;
+    for (int i = 0; i < 128; i++)
+    {
+        x = x * 1103515245 + 12345;
+        bytes.push_back((x >> 16) & 0xFF);
+    }
+    
+    return bytes;
+}
+
+Serial::packet Serial::rate_frame(unsigned char type, int rate)
+{
+    packet bytes;
+    bytes.push_back(control_marker);
+    bytes.push_back(type);
+    
+    for (int i = 0; i < 4; i++)
+        bytes.push_back((rate >> (8 * i)) & 0xFF);
+    
+    return bytes;
+}
+
+void Serial::write_control(const packet &bytes, int rate)
+{
+    PacketRing<int>::slot *slot = control_buffer.reserve();
+    if (!slot)
+        return;
+    
+    std::copy(bytes.begin(), bytes.end(), slot->data());
+    slot->set_size(bytes.size());
+    slot->info = rate;
+    if (frame_trailer)
+        add_trailer(*slot, 0, 0);
+    control_buffer.commit();
+    
+    trigger_tx(std::chrono::steady_clock::now());
+}
+
+unsigned char Serial::priority_byte(int priority)
+{
+    // A priority is sent as that many 1 bits, so a more urgent priority has a 0 bit wherever a less urgent one does.
+    // Its byte then wins arbitration against the other's, however many data lines the bits are spread over:
+    return (1u << std::max(0, std::min(priority, 8))) - 1;
+}
+
+Serial::packet Serial::ack_frame(unsigned char type, uint16_t sender, unsigned char seq, uint16_t crc)
+{
+    // The same bytes as the trailer of the frame it's about:
+    packet bytes;
+    bytes.push_back(control_marker);
+    bytes.push_back(type);
+    bytes.push_back(sender & 0xFF);
+    bytes.push_back(sender >> 8);
+    bytes.push_back(seq);
+    bytes.push_back(crc & 0xFF);
+    bytes.push_back(crc >> 8);
+    return bytes;
+}
+
+template <typename Slot>
+void Serial::add_trailer(Slot &slot, uint16_t sender, unsigned char seq)
+{
+    unsigned char *trailer = slot.data() + slot.size;
+    trailer[0] = sender & 0xFF;
+    trailer[1] = sender >> 8;
+    trailer[2] = seq;
+    
+    // The CRC covers the packet, the sender and the sequence number:
+    uint16_t crc = crc16(slot.data(), slot.size + 3);
+    trailer[3] = crc & 0xFF;
+    trailer[4] = crc >> 8;
+}
+
+bool Serial::check_trailer(PacketRing<>::slot &slot, uint16_t &sender, unsigned char &seq, uint16_t &crc)
+{
+    if (slot.size < frame_trailer)
+        return false;
+    
+    const unsigned char *trailer = slot.data() + slot.size - frame_trailer;
+    sender = trailer[0] | (trailer[1] << 8);
+    seq = trailer[2];
+    crc = trailer[3] | (trailer[4] << 8);
+    
+    if (crc16(slot.data(), slot.size - frame_trailer + 3) != crc)
+        return false;
+    
+    slot.size -= frame_trailer;
+    return true;
+}
+
+bool Serial::duplicate(uint16_t sender, unsigned char seq, uint16_t crc)
+{
+    for (const peer &p : peers)
+        if (p.id == sender)
+            return p.seq == seq && p.crc == crc;
+    return false;
+}
+
+void Serial::remember(uint16_t sender, unsigned char seq, uint16_t crc)
+{
+    peer *entry = nullptr;
+    for (peer &p : peers)
+        if (p.id == sender)
+            entry = &p;
+    
+    // A new sender takes the place of the one heard from longest ago once the list is full:
+    if (!entry && peers.size() < max_peers)
+    {
+        peers.push_back(peer());
+        entry = &peers.back();
+    }
+    else if (!entry)
+    {
+        entry = &*std::min_element(peers.begin(), peers.end(), [] (const peer &a, const peer &b) {
+            return a.heard < b.heard;
+        });
+    }
+    
+    entry->id = sender;
+    entry->seq = seq;
+    entry->crc = crc;
+    entry->heard = ++peer_clock;
+}
+
+void Serial::finish_ack()
+{
+    awaiting_ack = false;
+    
+    // The packet's done with once it's been acknowledged, or once it's been sent too many times.
+    // Otherwise (when it was NACKed or nothing replied) it's sent again:
+    if ((ack_received && !nack_received) || ++tx_retries > opts.max_retries)
+    {
+        tx_buffer.pop();
+        tx_retries = 0;
+    }
+    else
+    {
+        retransmissions++;
+    }
+    
+    trigger_tx(std::chrono::steady_clock::now());
+}
+
+void Serial::handle_control(const packet_view &bytes)
+{
+    if (bytes.size() < 2)
+        return;
+    
+    // Replies to the packet waiting to be acknowledged:
+    if (bytes[1] == CONTROL_ACK || bytes[1] == CONTROL_NACK)
+    {
+        if (!awaiting_ack || bytes.size() < ack_frame_size)
+            return;
+        
+        // Replies about other frames (e.g. a NACK for a frame whose trailer was corrupted) are ignored:
+        const unsigned char *trailer = tx_buffer.front().data() + tx_buffer.front().size;
+        if (!std::equal(trailer, trailer + crc_trailer_size, bytes.begin() + 2))
+            return;
+        
+        // The first reply decides what happens to the packet. All the receivers reply as soon as the frame's finished,
+        // so a NACK wins arbitration against any ACKs:
+        if (bytes[1] == CONTROL_NACK)
+            nack_received = true;
+        else
+            ack_received = true;
+        
+        ack_generation++; // cancels the timeout
+        finish_ack();
+        return;
+    }
+    
+    if (bytes.size() < 6)
+        return;
+    
+    int rate = bytes[2] | (bytes[3] << 8) | (bytes[4] << 16) | (bytes[5] << 24);
+    if (rate <= 0)
+        return;
+    
+    switch (bytes[1])
+    {
+        case CONTROL_PROBE:
+            probe_seen_rate = rate;
+            probe_seen_sum = fnv1a(bytes.begin(), bytes.size());
+            break;
+        
+        case CONTROL_PROBE_CHECK:
+        {
+            // The probe at that rate should have been received since the last check (with any packets in between):
+            packet expected = probe_frame(rate);
+            if (probe_seen_rate != rate || probe_seen_sum != fnv1a(expected.data(), expected.size()))
+                write_control(rate_frame(CONTROL_PROBE_FAIL, rate), opts.bitrate);
+            probe_seen_rate = 0;
+            break;
+        }
+        
+        case CONTROL_PROBE_FAIL:
+            // Only errors at the rate being probed by this node count, as other nodes may be probing too:
+            if (rate == probing_rate)
+            {
+                probe_failed = true;
+                probe_condition.notify_all();
+            }
+            break;
+        
+        case CONTROL_SET_RATE:
+            // A node which settled on a lower rate announces it again, in case the others missed it:
+            if (announced_rate != 0 && rate > announced_rate)
+                write_control(rate_frame(CONTROL_SET_RATE, announced_rate), opts.bitrate);
+            else
+                settle_rate(rate);
+            break;
+    }
+}
+
+void Serial::settle_rate(int rate)
+{
+    if (announced_rate == 0 || rate < announced_rate)
+    {
+        announced_rate = rate;
+        bus_rate = rate;
+    }
+}
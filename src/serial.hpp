@@ -6,9 +6,20 @@
 #include <thread>
 #include <mutex>
 #include <condition_variable>
+#include <functional>
+#include <chrono>
+#include <memory>
+#include <cstdint>
+#include <atomic>
+#include <random>
+#include <string>
 
 #include <QObject>
-    
+
+#include "pin_backend.hpp"
+#include "packet_ring.hpp"
+#include "histogram.hpp"
+
 class Serial : public QObject
 {
     Q_OBJECT
@@ -20,19 +31,120 @@ public:
     typedef std::vector<unsigned char> packet;
     
     /**
-     * Target bitrate in Hz.
+     * Datatype representing a read-only view of a packet held in one of the buffers of the instance.
+     */
+    typedef ::packet_view packet_view;
+    
+    /**
+     * Maximum number of bytes in a packet, and the most that can be allowed with extended length framing.
+     */
+    static const std::size_t max_packet_size = 256;
+    static const std::size_t max_extended_packet_size = 65535;
+    
+    /**
+     * First byte of the link control frames exchanged between instances (e.g. for bitrate probing).
+     * These are handled internally and never show up in the receive buffer, so packets
+     * starting with this byte can't be written.
      */
-    static const int bitrate = 1000;
+    static const unsigned char control_marker = 0xFF;
     
     /**
-     * SCL (clock) and SDA (data) pins.
+     * Priorities of packets. When frames carry priorities (see 'options::priorities') and several nodes start
+     * sending at once, the most urgent frame wins arbitration whatever its contents. Link control frames are
+     * more urgent than any packet.
+     */
+    enum priority
+    {
+        priority_interactive = 1, // e.g. strokes being drawn, which should show up on the other boards right away
+        priority_normal = 2,
+        priority_bulk = 3         // e.g. snapshots sent to other boards, which can wait
+    };
+    
+    /**
+     * Settings for an instance.
+     */
+    struct options
+    {
+        // Bitrate in Hz. This is also the rate used for link control frames, so it should be the same on all nodes.
+        int bitrate = 1000;
+        
+        // If set, pin changes are received as edge events from the pin backend instead of by
+        // polling the pins, falling back to polling if the backend doesn't support them.
+        bool edge_events = false;
+        
+        // If not zero, the instance samples the bus fast enough for this bitrate and, once started,
+        // steps the bitrate up towards it until any node sees bit errors. All nodes then settle on
+        // the highest rate that was received correctly.
+        int probe_bitrate = 0;
+        
+        // Number of packets each of the transmit and receive buffers can hold.
+        // Both are allocated up front, so no allocations happen while sending or receiving.
+        std::size_t buffer_packets = 128;
+        
+        // Frames start with a two byte length instead of one, so that packets can be longer than 'max_packet_size'
+        // (up to 'extended_max_packet', which is limited to 'max_extended_packet_size'). All nodes on the bus
+        // must use the same framing.
+        bool extended_length = false;
+        std::size_t extended_max_packet = 4096;
+        
+        // Adds the sender's id, a sequence number and CRC-16 to the end of every frame. Corrupted frames are dropped by
+        // the receivers, which acknowledge the frames they receive (or report corrupted ones), and packets which aren't
+        // acknowledged are sent again up to 'max_retries' times. Receivers keep track of the last packet from each
+        // sender, so a packet sent again after a missed ACK is only stored once. All nodes on the bus must have
+        // the same setting.
+        bool crc = false;
+        int max_retries = 3;
+        
+        // Extra SDA pins, clocked by the same SCL as 'pin_sda', so that each clock pulse moves a bit on every data line
+        // (bit i of each group on the i-th line, 'pin_sda' first). There must be 1, 3 or 7 of them, so that a byte takes
+        // a whole number of clock pulses. Start and stop conditions are only signalled on 'pin_sda', and a node loses
+        // arbitration if any of the lines it released is pulled low. All nodes must use the same number of lines.
+        std::vector<int> extra_data_pins;
+        
+        // Frames start with their priority (see 'priority'), so that arbitration between frames sent at once is decided
+        // by their priorities first. Less urgent packets also wait longer for the bus once it's idle, so that
+        // more urgent ones start first. All nodes on the bus must have the same setting.
+        bool priorities = false;
+        
+        // After sending a packet, the instance waits a little longer for the bus than the other nodes with packets
+        // of the same priority, until it sees the bus idle for that long. The nodes which lost arbitration to it then
+        // get the bus first, and one node can't keep the others waiting. Link control frames (e.g. ACKs) don't wait.
+        // Nodes can have different settings.
+        bool fair_access = false;
+    };
+    
+    /**
+     * SCL (clock) and SDA (data) pins. With extra data lines (see 'options::extra_data_pins'), 'pin_sda' is the first
+     * of them, which also carries the start and stop conditions.
      */
     const int pin_scl, pin_sda;
+
+#ifndef NO_WIRINGPI
+    /**
+     * Constructor, specifying the SCL and SDA pins on the Raspberry Pi GPIO header (using wiringPi).
+     */
+    Serial(int pin_scl, int pin_sda, const options &opts);
+#endif
+
+    /**
+     * Constructor, specifying the backend driving the pins as well as the SCL and SDA pins.
+     * The instance takes ownership of 'pins'.
+     * If the pins or options aren't valid (see 'check_options'), the instance is created stopped without
+     * touching the pins, and 'valid' returns false.
+     */
+    Serial(PinBackend *pins, int pin_scl, int pin_sda, const options &opts);
     
     /**
-     * Constructor, specifying the SCL and SDA pins.
+     * Returns what's wrong with the given pins and options, or an empty string if an instance can use them:
+     * the SCL and data pins must all be different, there must be 0, 1, 3 or 7 extra data pins,
+     * and the bitrate must be positive.
      */
-    Serial(int pin_scl, int pin_sda);
+    static std::string check_options(int pin_scl, int pin_sda, const options &opts);
+    
+    /**
+     * Returns whether the instance was created with valid pins and options (and was started).
+     */
+    bool valid() const;
     
     /**
      * Calls the `stop` function and then cleans up the instance.
@@ -50,6 +162,33 @@ public:
      */
     packet peek();
     
+    /**
+     * Returns a view of the next packet in the receive buffer without copying it, or an empty view
+     * if the buffer is empty. The view stays valid until 'release' is called.
+     * Only one thread should be reading packets (with any of 'read', 'peek', 'peek_view' and 'release').
+     */
+    packet_view peek_view();
+    
+    /**
+     * Removes the next packet from the receive buffer, invalidating the view returned by 'peek_view'.
+     */
+    void release();
+    
+    /**
+     * Returns the next free slot of the transmit buffer, for a packet of up to 'packet_limit()' bytes
+     * to be written into in place, or null if the buffer is full. The packet is queued by 'end_write'.
+     * Only one thread should be writing packets.
+     */
+    unsigned char *begin_write();
+    
+    /**
+     * Queues the packet written into the slot returned by 'begin_write', of the given size and priority.
+     * If the key isn't 0 and a packet with the same key is still waiting to be sent, the new packet
+     * replaces it (keeping its place in the buffer) instead of being added to the end.
+     * Returns whether the packet is valid (and was queued).
+     */
+    bool end_write(std::size_t size, uint32_t key = 0, int priority = priority_normal);
+    
     /**
      * Returns the number of packets available in the receive buffer.
      */
@@ -60,6 +199,58 @@ public:
      */
     std::size_t remaining();
     
+    /**
+     * Returns the maximum number of bytes in a packet, which depends on the framing.
+     */
+    std::size_t packet_limit();
+    
+    /**
+     * Returns the number of times a packet had to be sent again because it wasn't acknowledged.
+     */
+    uint64_t retransmitted();
+    
+    /**
+     * Counters and histograms describing how the bus is doing, see 'statistics'.
+     */
+    struct stats
+    {
+        uint64_t frames_sent = 0;      // frames transmitted completely, including control frames and resent packets
+        uint64_t frames_received = 0;  // packets received and stored in the receive buffer
+        uint64_t frames_dropped = 0;   // frames received but dropped (corrupted, too long or with the receive buffer full)
+        uint64_t arbitration_lost = 0; // transmissions given up because another node won arbitration
+        uint64_t bits = 0;             // bits clocked on the bus, whichever node sent them
+        uint64_t retransmissions = 0;  // see 'retransmitted'
+        uint64_t bytes_saved = 0;      // see 'saved_bytes'
+        
+        double bits_per_second = 0;    // bits clocked on the bus per second, measured over about a second
+        std::size_t tx_depth = 0;      // packets waiting in the transmit buffer
+        std::size_t tx_depth_max = 0;  // most packets there have been waiting in the transmit buffer
+        std::size_t rx_depth = 0;      // packets waiting in the receive buffer
+        long max_edge_latency = 0;     // see 'max_edge_latency'
+        
+        histogram queue_delay;         // microseconds from a packet being written to starting to send it
+    };
+    
+    /**
+     * Returns a copy of the statistics. The counters are only ever added to while the bus is running
+     * (under the lock that's held anyway), so they're cheap enough to always be kept.
+     */
+    stats statistics();
+    
+    /**
+     * Sets a function to be called as packets go through each stage of being sent or received, for tracing them.
+     * It's given the name of the stage and the FNV-1a hash of the packet's bytes (which identifies the packet on
+     * both sides of the bus). It's called on the engine thread with the lock held, so it must be quick and mustn't
+     * call back into the instance.
+     */
+    void set_trace_hook(std::function<void(const char *stage, uint32_t packet_id)> hook);
+    
+    /**
+     * Returns the number of bytes (including the framing) which didn't need to be sent
+     * because their packets were cancelled or replaced before being sent.
+     */
+    uint64_t saved_bytes();
+    
     /**
      * Blocks until data is available in the receive buffer, or until the timeout,
      * and returns the number of packets available.
@@ -77,46 +268,294 @@ public:
      * Returns whether the instance has been stopped.
      */
     bool stopped();
+    
+    /**
+     * Returns the bitrate currently used for transmitting packets, in Hz.
+     */
+    int bitrate();
+    
+    /**
+     * Returns whether pin changes are received as edge events (rather than by polling).
+     */
+    bool edge_events();
+    
+    /**
+     * Returns the worst delay seen, in microseconds, between a pin edge and its interrupt routine being run.
+     * Only measured when using edge events.
+     */
+    long max_edge_latency();
 
 public slots:
     /**
      * Checks if a packet is valid and puts it on the transmit buffer if it is.
      * Returns whether the packet is valid.
      */
-    bool write(packet bytes);
+    bool write(const packet &bytes);
+    
+    /**
+     * Same as 'write', but replaces any packet with the same key which is still waiting to be sent
+     * (see 'end_write'). A key of 0 never replaces anything.
+     */
+    bool write_keyed(const packet &bytes, uint32_t key);
+    
+    /**
+     * Replaces the packet with the given key if it's still waiting to be sent, and otherwise does nothing,
+     * so that a packet can be extended for as long as it hasn't gone out (but isn't sent twice if it has).
+     * Returns whether the packet was replaced.
+     */
+    bool replace(const packet &bytes, uint32_t key, int priority = priority_normal);
+    
+    /**
+     * Same as 'write', with the given priority (see 'priority') rather than 'priority_normal',
+     * and optionally a key (see 'write_keyed').
+     */
+    bool write_prioritized(const packet &bytes, int priority, uint32_t key = 0);
+    
+    /**
+     * Drops all the packets waiting in the transmit buffer (but not one that's already being sent).
+     * Returns the number of packets dropped.
+     */
+    std::size_t cancel_pending();
 
 signals:
     /**
-     * Emitted when a packet is received.
+     * Emitted when a packet is received. Packets received before the receive buffer has been emptied
+     * are not signalled again, so the receiver should read until there are no packets left.
      */
     void packet_received(Serial *serial);
-    
+
 private:
     // Any access to variables in this class should lock this mutex.
     std::mutex mtx;
     
-    // Variables for assisting with stopping the instance.
+    // Whether the pins and options were valid, and variables for assisting with stopping the instance.
+    bool is_valid = false;
     bool finish = false;
     bool is_stopped = false;
     unsigned int thread_count = 0;
     std::condition_variable_any stop_condition;
     
-    // Transmit and receive buffers.
-    std::queue<packet> tx_buffer, rx_buffer;
+    const options opts;
+    
+    // All the data pins ('pin_sda' first), and the number of them, being the number of bits moved by each clock pulse.
+    const std::vector<int> data_pins;
+    const unsigned int data_lines;
+    
+    // Maximum packet size, number of priority bytes at the start of each frame, number of length bytes after them
+    // and number of bytes after the packet in each frame (the CRC trailer), set by the framing.
+    const std::size_t packet_max, frame_prefix, frame_header, frame_trailer;
+    
+    // Random id of this node, sent in the trailer of its packets so that receivers can tell the senders apart.
+    const uint16_t node_id;
+    
+    // Bitrate for packets, and the bitrate of the frame currently being transmitted.
+    int bus_rate, tx_rate;
     
-    // Variables for keeping track of a transmission/reception.
+    // Transmit and receive buffers. Each packet in the transmit buffer has a key for replacing it by
+    // a later packet, and can be cancelled (left in the buffer but skipped, as it could be in the middle).
+    struct tx_info
+    {
+        uint32_t key = 0;
+        bool cancelled = false;
+        int priority = priority_normal;
+        
+        // When the packet was written, until its queueing delay has been recorded.
+        std::chrono::steady_clock::time_point queued;
+        
+        // Hash of the packet for tracing, only worked out when there's a trace hook.
+        uint32_t trace_id = 0;
+    };
+    typedef PacketRing<tx_info>::slot tx_slot;
+    PacketRing<tx_info> tx_buffer;
+    PacketRing<> rx_buffer;
+    
+    // Number of cancelled packets in the transmit buffer, and bytes saved by cancelling and replacing packets.
+    std::size_t tx_cancelled = 0;
+    uint64_t bytes_saved = 0;
+    
+    // Acknowledgement of the packet at the front of the transmit buffer, when CRCs are used.
+    unsigned char tx_seq = 0;
+    bool awaiting_ack = false, ack_received = false, nack_received = false;
+    unsigned int ack_generation = 0;
+    int tx_retries = 0;
+    uint64_t retransmissions = 0;
+    
+    // Called as packets go through each stage, see 'set_trace_hook'.
+    std::function<void(const char *, uint32_t)> trace_hook;
+    
+    // Statistics, and the bit count and time the bitrate was last measured from.
+    stats counters;
+    uint64_t rate_mark_bits = 0;
+    std::chrono::steady_clock::time_point rate_mark_time;
+    
+    // Sequence number and CRC of the last packet received from each sender, for spotting packets sent again after
+    // a missed ACK. Room is made for a new sender by forgetting the one heard from longest ago.
+    struct peer
+    {
+        uint16_t id;
+        unsigned char seq;
+        uint16_t crc;
+        uint64_t heard; // value of 'peer_clock' when the last packet was received from it
+    };
+    std::vector<peer> peers;
+    uint64_t peer_clock = 0;
+    
+    // Returns whether a packet is the last one received from its sender, or remembers it as that sender's last one.
+    // 'mtx' must be locked before calling either of these.
+    bool duplicate(uint16_t sender, unsigned char seq, uint16_t crc);
+    void remember(uint16_t sender, unsigned char seq, uint16_t crc);
+    
+    // Returns the index of the first packet in the transmit buffer which isn't being sent.
+    // 'mtx' must be locked before calling this.
+    std::size_t first_pending();
+    
+    // Returns the number of bytes a packet of the given size takes up on the bus, with its framing.
+    std::size_t frame_size(std::size_t size);
+    
+    // Queues the packet in the reserved slot (see 'end_write'), or with 'replace_only' only puts it
+    // in place of a waiting packet with the same key, returning false if there isn't one.
+    bool commit_write(std::size_t size, uint32_t key, int priority, bool replace_only);
+    
+    // Link control frames waiting to be transmitted (along with their bitrate), which go before any packets.
+    PacketRing<int> control_buffer;
+    bool tx_control = false;
+    
+    // Variables for keeping track of a transmission/reception, including the length read from the frame being received.
     unsigned int byte_pos, bit_pos;
-    bool tx_bit_val;
+    unsigned char tx_bits;
     unsigned char rx_byte;
-    packet rx_packet;
+    std::size_t rx_length;
+    
+    // Priority byte of the frame being transmitted (as sent), and the number of priority bytes left to go.
+    unsigned char tx_priority;
+    unsigned int prefix_left;
+    
+    // Set after sending a packet with 'fair_access', until the bus has been idle long enough for the other nodes to start.
+    bool fair_defer = false;
+    
+    // Frame being transmitted, which stays at the front of its buffer until it's finished.
+    const unsigned char *tx_frame;
+    std::size_t tx_size;
+    
+    // Slot the frame being received is written into. This is the reserved slot of the receive buffer,
+    // or a scratch slot if the receive buffer is full (or the frame is too long) so the frame is dropped.
+    PacketRing<>::slot *rx_slot, rx_scratch;
+    std::vector<unsigned char> rx_scratch_frame;
+    bool rx_dropped;
+    
+    // Checksums of the frame being received and of the last complete frame.
+    uint32_t rx_sum, last_rx_sum = 0;
+    
+    // Time of the edge being handled, which clock pulses and transmissions are timed from
+    // so that delays in handling the edges don't add up.
+    std::chrono::steady_clock::time_point edge_time;
+    
+    // Time the current clock pulse started from.
+    std::chrono::steady_clock::time_point clock_from;
+    
+    // Time of the last clock edge, for detecting a bus that stopped mid-frame.
+    std::chrono::steady_clock::time_point activity_time;
+    
+    // Time the bus was last seen going idle (at a stop condition, or when this node started again after a frame was cut
+    // short or abandoned), which the waits before starting a transmission are timed from.
+    std::chrono::steady_clock::time_point idle_time;
     
     std::condition_variable_any available_condition;
+    unsigned int available_waiters = 0;
+    
+    // Set when 'packet_received' has been emitted and the reader hasn't emptied the receive buffer since.
+    std::atomic<bool> notify_pending{false};
+    
+    // Returns whether the receive buffer is empty, allowing the next packet to be signalled if it is.
+    bool rx_empty();
+    
+    // Variables for the bitrate probe: the rate this node is probing (0 if none) and whether another node reported
+    // errors at that rate, the rate and checksum of the last probe received from another node, and the lowest rate
+    // announced by any node (0 until one is), which all the nodes settle on.
+    int probing_rate = 0;
+    bool probe_failed = false;
+    int probe_seen_rate = 0;
+    uint32_t probe_seen_sum = 0;
+    int announced_rate = 0;
+    std::condition_variable_any probe_condition;
+    
+    // Switches to an announced bitrate if it's the lowest one so far. 'mtx' must be locked before calling this.
+    void settle_rate(int rate);
+    
+    // Backend driving the pins, and the source of pin change events (or null when polling the pins).
+    std::unique_ptr<PinBackend> pins;
+    std::unique_ptr<EdgeSource> edges;
+    std::chrono::steady_clock::duration max_latency = std::chrono::steady_clock::duration::zero();
     
     enum { IDLE, TX, RX } state = IDLE;
     
+    // Pin levels as of the edge being handled. The interrupt routines use these rather than reading
+    // the pins again, since with edge events the pins may have changed by the time an edge is dispatched.
+    bool level_scl = true, level_sda = true;
+    
+    // Timer queue run by the engine thread, ordered by deadline (earliest first).
+    struct timer_event
+    {
+        std::chrono::steady_clock::time_point deadline;
+        std::function<void()> action;
+        
+        bool operator>(const timer_event &other) const { return deadline > other.deadline; }
+    };
+    std::priority_queue<timer_event, std::vector<timer_event>, std::greater<timer_event>> timer_queue;
+    std::condition_variable_any timer_condition;
+    
     // Starts a thread in charge of checking the pin values and dispatching the pin change interrupts.
+    // Waits for edge events if there's an edge source, otherwise polls the pins.
     void pin_thread();
     
+    // Dispatches a pin change to the matching interrupt routine. 'mtx' must be locked before calling this.
+    void dispatch(const EdgeSource::edge &e);
+    
+    // Starts the long-lived engine thread, which runs the actions in the timer queue once their deadline is reached.
+    void engine_thread();
+    
+    // Schedules an action to be run by the engine thread (with 'mtx' locked) at the given time.
+    // 'mtx' must be locked before calling this.
+    void schedule(std::chrono::steady_clock::time_point deadline, std::function<void()> action);
+    
+    // Returns half of a clock cycle at the given bitrate.
+    static std::chrono::nanoseconds half_period(int rate);
+    
+    // Starts a thread which steps up the bitrate until bit errors are reported, then announces the
+    // highest good rate to the other nodes.
+    void probe_thread();
+    
+    // Returns the frame sent to probe the given bitrate.
+    static packet probe_frame(int rate);
+    
+    // Returns a link control frame of the given type, carrying a bitrate.
+    static packet rate_frame(unsigned char type, int rate);
+    
+    // Queues a link control frame to be transmitted at the given bitrate.
+    // 'mtx' must be locked before calling this.
+    void write_control(const packet &bytes, int rate);
+    
+    // Returns the priority byte sent for a priority, which wins arbitration against the bytes of less urgent priorities.
+    static unsigned char priority_byte(int priority);
+    
+    // Returns an ACK or NACK frame for a packet, identified by its sender, sequence number and CRC.
+    static packet ack_frame(unsigned char type, uint16_t sender, unsigned char seq, uint16_t crc);
+    
+    // Fills in the trailer after the packet in a slot. The slot must have room for it.
+    template <typename Slot>
+    void add_trailer(Slot &slot, uint16_t sender, unsigned char seq);
+    
+    // Checks the trailer of a received frame and removes it, returning false if the frame is corrupted.
+    // The sender, sequence number and CRC are read from the trailer either way (if the frame's long enough).
+    bool check_trailer(PacketRing<>::slot &slot, uint16_t &sender, unsigned char &seq, uint16_t &crc);
+    
+    // Decides whether the packet waiting to be acknowledged is done with or needs sending again,
+    // once the receivers have had time to reply. 'mtx' must be locked before calling this.
+    void finish_ack();
+    
+    // Handles a received link control frame. 'mtx' must be locked before calling this.
+    void handle_control(const packet_view &bytes);
+    
     // Iterrupt routines for pin changes.
     // 'mtx' must be locked before calling any of these.
     void isr_scl_rise();
@@ -124,10 +563,32 @@ private:
     void isr_sda_rise();
     void isr_sda_fall();
     
-    // Methods for triggering a transmission, and for generating a clock pulse.
+    // Methods for triggering a transmission half a clock cycle after the bus went idle (but no sooner than the given time),
+    // and for starting a clock pulse from the given time. Both schedule their work on the engine thread rather than blocking.
+    // 'mtx' must be locked before calling either of these.
+    void trigger_tx(std::chrono::steady_clock::time_point from);
+    void clock_pulse(std::chrono::steady_clock::time_point from);
+    
+    // Checks that the bus is still moving during a frame, and gives up on the frame if it isn't,
+    // so that a node losing track of the bus (e.g. due to bit errors) can't stall it forever.
+    // Starting a watchdog stops any earlier one, which would otherwise keep checking alongside it.
+    // 'mtx' must be locked before calling either of these.
+    void watchdog();
+    void watchdog_check(unsigned int generation);
+    
+    // Incremented whenever this node starts or abandons a transmission, so that a clock pulse scheduled for an
+    // abandoned frame doesn't pull SCL low (with nothing left to release it), and whenever a watchdog is started.
+    unsigned int tx_generation = 0, watchdog_generation = 0;
+    
+    // Random numbers for spreading out the nodes starting again after a frame was cut short or abandoned,
+    // and the random delay for a node to wait before starting again. 'mtx' must be locked before calling this.
+    std::minstd_rand restart_random;
+    std::chrono::nanoseconds restart_delay();
+    
+    // Releases all the data lines, or returns whether they're all released.
     // 'mtx' must be locked before calling either of these.
-    void trigger_tx();
-    void clock_pulse();
+    void release_data();
+    bool data_released();
 };
 
 #endif /* SERIAL_HPP */
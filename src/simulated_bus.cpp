@@ -0,0 +1,182 @@
+#include "simulated_bus.hpp"
+
+#include <algorithm>
+#include <chrono>
+
+SimulatedBus::Node::Node(SimulatedBus &bus) : bus(bus) { }
+
+SimulatedBus::Node::~Node()
+{
+    std::lock_guard<std::mutex> lock(bus.mtx);
+    
+    while (pulled_low.size())
+        bus.drive(*this, pulled_low.front(), true);
+    
+    bus.nodes.erase(this);
+}
+
+void SimulatedBus::Node::set_level(int pin, bool level)
+{
+    std::lock_guard<std::mutex> lock(bus.mtx);
+    bus.drive(*this, pin, level);
+}
+
+bool SimulatedBus::Node::get_level(int pin)
+{
+    std::lock_guard<std::mutex> lock(bus.mtx);
+    return bus.level(pin) != (pin == bus.error_data && data_flipped);
+}
+
+EdgeSource *SimulatedBus::Node::edge_source(int pin_a, int pin_b)
+{
+    return new Edges(bus, this, pin_a, pin_b);
+}
+
+SimulatedBus::Edges::Edges(SimulatedBus &bus, Node *node, int pin_a, int pin_b) : bus(bus), node(node)
+{
+    pins[0] = pin_a;
+    pins[1] = pin_b;
+    
+    std::lock_guard<std::mutex> lock(bus.mtx);
+    bus.listeners.push_back(this);
+}
+
+SimulatedBus::Edges::~Edges()
+{
+    std::lock_guard<std::mutex> lock(bus.mtx);
+    bus.listeners.erase(std::find(bus.listeners.begin(), bus.listeners.end(), this));
+}
+
+bool SimulatedBus::Edges::wait_edge(edge &e, long timeout_micros)
+{
+    std::unique_lock<std::mutex> lock(bus.mtx);
+    
+    if (pending_head == pending.size())
+    {
+        if (timeout_micros >= 0)
+            pending_condition.wait_for(lock, std::chrono::microseconds(timeout_micros));
+        else
+            pending_condition.wait(lock);
+    }
+    
+    if (pending_head == pending.size())
+        return false;
+    
+    e = pending[pending_head++];
+    if (pending_head == pending.size())
+    {
+        pending.clear();
+        pending_head = 0;
+    }
+    return true;
+}
+
+SimulatedBus::Node *SimulatedBus::connect()
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    
+    Node *node = new Node(*this);
+    nodes.insert(node);
+    return node;
+}
+
+bool SimulatedBus::get_level(int pin)
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    return level(pin);
+}
+
+void SimulatedBus::set_bit_errors(int pin_clock, int pin_data, double rate)
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    
+    error_clock = pin_clock;
+    error_data = pin_data;
+    error_rate = rate;
+}
+
+void SimulatedBus::drive(Node &node, int pin, bool level)
+{
+    bool old_level = this->level(pin);
+    
+    // The lines stay in the map once they've been used, so that toggling them doesn't allocate:
+    std::vector<int>::iterator pulled = std::find(node.pulled_low.begin(), node.pulled_low.end(), pin);
+    if (!level && pulled == node.pulled_low.end())
+    {
+        node.pulled_low.push_back(pin);
+        low_counts[pin]++;
+    }
+    else if (level && pulled != node.pulled_low.end())
+    {
+        node.pulled_low.erase(pulled);
+        low_counts[pin]--;
+    }
+    
+    bool new_level = this->level(pin);
+    if (new_level == old_level)
+        return;
+    
+    bool clock_errors = pin == error_clock && error_rate > 0;
+    
+    // As the clock rises, pick the nodes which see the wrong data bit (which they see change just before the clock):
+    if (clock_errors && new_level)
+    {
+        std::uniform_real_distribution<double> chance(0, 1);
+        for (Node *other : nodes)
+        {
+            if (other != &node && chance(random) < error_rate)
+            {
+                other->data_flipped = true;
+                notify(error_data, !this->level(error_data), other);
+            }
+        }
+    }
+    
+    notify(pin, new_level, nullptr);
+    
+    // Nodes seeing the data line inverted miss the change, after which they see it correctly again:
+    if (pin == error_data)
+    {
+        for (Node *other : nodes)
+            other->data_flipped = false;
+    }
+    
+    // Once the clock falls, they see the actual data again:
+    if (clock_errors && !new_level)
+    {
+        for (Node *other : nodes)
+        {
+            if (other->data_flipped)
+            {
+                other->data_flipped = false;
+                notify(error_data, this->level(error_data), other);
+            }
+        }
+    }
+}
+
+void SimulatedBus::notify(int pin, bool level, Node *only)
+{
+    EdgeSource::edge e;
+    e.pin = pin;
+    e.timestamp = std::chrono::steady_clock::now();
+    
+    for (Edges *listener : listeners)
+    {
+        // Nodes seeing the data line inverted don't see its actual edges:
+        bool flipped = pin == error_data && !only && listener->node && listener->node->data_flipped;
+        
+        if ((listener->pins[0] == pin || listener->pins[1] == pin) && (!only || listener->node == only) && !flipped)
+        {
+            e.rising = level;
+            listener->pending.push_back(e);
+            listener->pending_condition.notify_all();
+        }
+    }
+}
+
+bool SimulatedBus::level(int pin)
+{
+    std::map<int, int>::const_iterator count = low_counts.find(pin);
+    return count == low_counts.end() || count->second == 0;
+}
@@ -0,0 +1,120 @@
+#ifndef SIMULATED_BUS_HPP
+#define SIMULATED_BUS_HPP
+
+#include <map>
+#include <set>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <random>
+
+#include "pin_backend.hpp"
+
+/**
+ * In-process simulation of an open-drain, wired-AND bus.
+ * Each 'Serial' instance connects through its own node, and a line reads low whenever any node pulls it low,
+ * so several instances in one process contend for the bus just like boards on real wires do.
+ */
+class SimulatedBus
+{
+public:
+    /**
+     * A single device's connection to the bus.
+     */
+    class Node : public PinBackend
+    {
+    public:
+        /**
+         * Releases any pins still pulled low by this node and disconnects it from the bus.
+         */
+        ~Node();
+        
+        void set_level(int pin, bool level) override;
+        bool get_level(int pin) override;
+        EdgeSource *edge_source(int pin_a, int pin_b) override;
+    
+    private:
+        friend class SimulatedBus;
+        Node(SimulatedBus &bus);
+        
+        SimulatedBus &bus;
+        std::vector<int> pulled_low; // lines this node is pulling low
+        
+        // Whether this node currently sees the data line inverted (see 'set_bit_errors').
+        bool data_flipped = false;
+    };
+    
+    /**
+     * Edge events on two lines of the bus, as seen by one node.
+     */
+    class Edges : public EdgeSource
+    {
+    public:
+        /**
+         * Stops listening to the bus.
+         */
+        ~Edges();
+        
+        bool wait_edge(edge &e, long timeout_micros) override;
+    
+    private:
+        friend class SimulatedBus;
+        Edges(SimulatedBus &bus, Node *node, int pin_a, int pin_b);
+        
+        SimulatedBus &bus;
+        Node *node;
+        int pins[2];
+        
+        // Edges not read yet, from 'pending_head' on. The vector is only emptied (keeping its storage) once
+        // they've all been read, so that queueing edges doesn't allocate.
+        std::vector<edge> pending;
+        std::size_t pending_head = 0;
+        std::condition_variable pending_condition;
+    };
+    
+    /**
+     * Connects a new node to the bus. The caller takes ownership of the node,
+     * which must be destroyed before the bus.
+     */
+    Node *connect();
+    
+    /**
+     * Returns the current level of a line.
+     */
+    bool get_level(int pin);
+    
+    /**
+     * Makes nodes see bit errors on the data line. Each time the clock line rises, every node except the one
+     * releasing it (the one sending) sees the data line inverted with the given probability, until the clock falls again.
+     * A rate of 0 turns the errors off.
+     */
+    void set_bit_errors(int pin_clock, int pin_data, double rate);
+
+private:
+    // Any access to variables in this class should lock this mutex.
+    std::mutex mtx;
+    
+    // Number of nodes pulling each line low. Lines not in the map (or with a count of 0) are high.
+    std::map<int, int> low_counts;
+    
+    std::vector<Edges *> listeners;
+    std::set<Node *> nodes;
+    
+    // Bit error injection.
+    int error_clock = -1, error_data = -1;
+    double error_rate = 0;
+    std::mt19937 random;
+    
+    // Queues an edge for the listeners on a line, as seen by one node (or by all the nodes if null).
+    // 'mtx' must be locked before calling this.
+    void notify(int pin, bool level, Node *only);
+    
+    // Pulls a line low or releases it on behalf of a node, notifying the listeners if the level changes.
+    // 'mtx' must be locked before calling this.
+    void drive(Node &node, int pin, bool level);
+    
+    // 'mtx' must be locked before calling this.
+    bool level(int pin);
+};
+
+#endif /* SIMULATED_BUS_HPP */
@@ -0,0 +1,94 @@
+#include "tracer.hpp"
+#include "fnv1a.hpp"
+
+#include <fstream>
+#include <set>
+#include <cstdio>
+
+Tracer::Tracer(const std::string &path) : path(path), start(std::chrono::steady_clock::now())
+{
+    records.reserve(1 << 16);
+}
+
+Tracer::~Tracer()
+{
+    std::ofstream out(path);
+    if (!out)
+        return;
+    
+    // Find the first and last stage of each packet, where its async slice starts and ends
+    // (stages aren't always recorded in order, as some are recorded after the event):
+    std::map<uint32_t, std::pair<std::size_t, std::size_t>> spans;
+    for (std::size_t i = 0; i < records.size(); i++)
+    {
+        auto span = spans.find(records[i].id);
+        if (span == spans.end())
+        {
+            spans[records[i].id] = std::make_pair(i, i);
+            continue;
+        }
+        
+        if (records[i].time < records[span->second.first].time)
+            span->second.first = i;
+        if (records[i].time >= records[span->second.second].time)
+            span->second.second = i;
+    }
+    
+    out << "{\"traceEvents\":[" << std::endl;
+    
+    std::set<int> nodes;
+    for (const record &r : records)
+        nodes.insert(r.node);
+    for (int node : nodes)
+        out << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" << node << ",\"args\":{\"name\":\"node " << node << "\"}}," << std::endl;
+    
+    for (std::size_t i = 0; i < records.size(); i++)
+    {
+        const record &r = records[i];
+        double ts = std::chrono::duration<double, std::micro>(r.time - start).count();
+        
+        char id[16];
+        snprintf(id, sizeof(id), "0x%08x", r.id);
+        
+        out << "{\"name\":\"" << r.stage << "\",\"cat\":\"stage\",\"ph\":\"i\",\"s\":\"t\",\"ts\":" << ts
+            << ",\"pid\":" << r.node << ",\"tid\":" << r.thread << ",\"args\":{\"packet\":\"" << id << "\"}}";
+        
+        const std::pair<std::size_t, std::size_t> &span = spans[r.id];
+        if (span.first != span.second && (i == span.first || i == span.second))
+        {
+            out << "," << std::endl << "{\"name\":\"packet " << id << "\",\"cat\":\"packet\",\"ph\":\"" << (i == span.first ? "b" : "e")
+                << "\",\"id2\":{\"global\":\"" << id << "\"},\"ts\":" << ts << ",\"pid\":" << r.node << ",\"tid\":" << r.thread << "}";
+        }
+        
+        out << (i + 1 < records.size() ? "," : "") << std::endl;
+    }
+    
+    out << "]}" << std::endl;
+}
+
+uint32_t Tracer::packet_id(const unsigned char *data, std::size_t length)
+{
+    return fnv1a(data, length);
+}
+
+void Tracer::trace(int node, const char *stage, uint32_t id)
+{
+    trace(node, stage, id, std::chrono::steady_clock::now());
+}
+
+void Tracer::trace(int node, const char *stage, uint32_t id, std::chrono::steady_clock::time_point time)
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    
+    auto thread = threads.find(std::this_thread::get_id());
+    if (thread == threads.end())
+        thread = threads.insert(std::make_pair(std::this_thread::get_id(), (int) threads.size())).first;
+    
+    record r;
+    r.time = time;
+    r.node = node;
+    r.thread = thread->second;
+    r.stage = stage;
+    r.id = id;
+    records.push_back(r);
+}
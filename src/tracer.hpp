@@ -0,0 +1,68 @@
+#ifndef TRACER_HPP
+#define TRACER_HPP
+
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <cstdint>
+
+/**
+ * Records the stages each packet goes through on every node, and writes them out as a Chrome trace
+ * (JSON which can be opened in Perfetto or chrome://tracing) when it's destroyed.
+ *
+ * Packets are identified by the FNV-1a hash of their bytes, which the sender and the receivers can all work out
+ * without anything being added to the packets. Each stage shows up as an instant event on the node (as a process)
+ * and thread that recorded it, and each packet as an async slice from its first stage to its last one on any node.
+ * All the nodes have to be in the same process (e.g. on a simulated bus), as they share the clock.
+ */
+class Tracer
+{
+public:
+    /**
+     * Starts a trace, to be written to the given file.
+     */
+    Tracer(const std::string &path);
+    
+    /**
+     * Writes out the trace.
+     */
+    ~Tracer();
+    
+    /**
+     * Returns the id of a packet, being the FNV-1a hash of its bytes.
+     */
+    static uint32_t packet_id(const unsigned char *data, std::size_t length);
+    
+    /**
+     * Records that a packet went through a stage on a node, now or at the given time.
+     * The stage name must stay valid until the trace is written (e.g. a string literal).
+     * Can be called from any thread.
+     */
+    void trace(int node, const char *stage, uint32_t id);
+    void trace(int node, const char *stage, uint32_t id, std::chrono::steady_clock::time_point time);
+    
+private:
+    struct record
+    {
+        std::chrono::steady_clock::time_point time;
+        int node;
+        int thread;
+        const char *stage;
+        uint32_t id;
+    };
+    
+    std::string path;
+    std::chrono::steady_clock::time_point start;
+    
+    // Any access to the records should lock this mutex.
+    std::mutex mtx;
+    std::vector<record> records;
+    
+    // Small numbers for the threads which have recorded stages, as the trace's thread ids.
+    std::map<std::thread::id, int> threads;
+};
+
+#endif /* TRACER_HPP */
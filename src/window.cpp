@@ -23,6 +23,10 @@ Window::Window(QWidget *parent) :
     colourButton->setMenu(colourMenu);
     ui->mainToolBar->addWidget(colourButton);
 
+    QAction *statsAction = ui->mainToolBar->addAction("stats"); // shows the bus and drawing statistics over the canvas
+    statsAction->setCheckable(true);
+    connect(statsAction, &QAction::toggled, ui->centralWidget, &canvas::showStatistics);
+
     connect(colourButton, &QToolButton::triggered, ui->centralWidget, &canvas::selectColor);
     connect(ui->mainToolBar, &QToolBar::actionTriggered, ui->centralWidget, &canvas::selectTool);   // connects tool bar button to slot
 }
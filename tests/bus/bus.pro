@@ -0,0 +1,14 @@
+# Tests of the bus, run on the simulated bus.
+TARGET = tst_bus
+CONFIG += console testcase
+CONFIG -= app_bundle
+
+DESTDIR = build
+OBJECTS_DIR = build/.obj
+MOC_DIR = build/.moc
+
+include(../../headless.pri)
+
+SOURCES += tst_bus.cpp
+
+QT = core testlib
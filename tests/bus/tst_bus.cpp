@@ -0,0 +1,287 @@
+#include "serial.hpp"
+#include "simulated_bus.hpp"
+
+#include <QtTest>
+
+#include <vector>
+#include <set>
+#include <memory>
+#include <chrono>
+#include <unistd.h>
+
+// Checks the bus on a simulated bus, with several nodes in the process sending to each other.
+class BusTest : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void probeConvergesWithTraffic_data();
+    void probeConvergesWithTraffic();
+    void deliversOnceWithBitErrors_data();
+    void deliversOnceWithBitErrors();
+    void replacesOnlyWaitingPackets();
+    void skipsCancelledPriorities();
+    void rejectsInvalidDataLines();
+};
+
+static const int pinScl = 0;
+static const int pinSda = 1;
+
+void BusTest::probeConvergesWithTraffic_data()
+{
+    QTest::addColumn<int>("probers");
+    
+    QTest::newRow("one node probing") << 1;
+    QTest::newRow("all nodes probing") << 3;
+}
+
+// Three nodes keep sending packets while some of them step up the bitrate. However the probes and packets are
+// interleaved, all the nodes must end up on the same bitrate.
+void BusTest::probeConvergesWithTraffic()
+{
+    QFETCH(int, probers);
+    
+    const int nodeCount = 3;
+    const int baseRate = 2000;
+    const int probeRate = 16000;
+    
+    // The bus is declared first, so that it outlives the nodes:
+    SimulatedBus bus;
+    std::vector<std::unique_ptr<Serial>> nodes;
+    for(int i = 0; i < nodeCount; i++)
+    {
+        Serial::options opts;
+        opts.bitrate = baseRate;
+        opts.edge_events = true;
+        opts.probe_bitrate = i < probers ? probeRate : 0;
+        nodes.emplace_back(new Serial(bus.connect(), pinScl, pinSda, opts));
+    }
+    
+    // Probing takes a few seconds at most, even when the probes have to wait for the packets:
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now() + std::chrono::seconds(8);
+    while(std::chrono::steady_clock::now() < end)
+    {
+        for(int i = 0; i < nodeCount; i++)
+        {
+            if(nodes[i]->remaining() == 0)
+                nodes[i]->write(Serial::packet(24, i + 1));
+            
+            for(Serial::packet_view p = nodes[i]->peek_view(); !p.empty(); p = nodes[i]->peek_view())
+                nodes[i]->release();
+        }
+        usleep(2000);
+    }
+    
+    qInfo("Settled on %d, %d and %d Hz", nodes[0]->bitrate(), nodes[1]->bitrate(), nodes[2]->bitrate());
+    for(int i = 1; i < nodeCount; i++)
+        QCOMPARE(nodes[i]->bitrate(), nodes[0]->bitrate());
+    QVERIFY(nodes[0]->bitrate() >= baseRate);
+    if(probers == 1)
+        QCOMPARE(nodes[0]->bitrate(), probeRate);
+}
+
+void BusTest::deliversOnceWithBitErrors_data()
+{
+    QTest::addColumn<double>("bitErrorRate");
+    
+    QTest::newRow("no errors") << 0.0;
+    QTest::newRow("1e-3") << 0.001;
+    QTest::newRow("2e-3") << 0.002;
+    QTest::newRow("5e-3") << 0.005;
+}
+
+// Three nodes with CRCs each send numbered packets to the other two through a bus flipping bits at random.
+// Packets sent again (after a missed ACK or a NACK) must only be received once, whichever nodes sent in between.
+// Reports the goodput: the bytes of distinct packets received per second.
+void BusTest::deliversOnceWithBitErrors()
+{
+    QFETCH(double, bitErrorRate);
+    
+    const int nodeCount = 3;
+    const int packetsPerNode = 20;
+    const std::size_t packetSize = 32;
+    
+    Serial::options opts;
+    opts.bitrate = 8000;
+    opts.edge_events = true;
+    opts.crc = true;
+    
+    // The bus is declared first, so that it outlives the nodes:
+    SimulatedBus bus;
+    bus.set_bit_errors(pinScl, pinSda, bitErrorRate);
+    std::vector<std::unique_ptr<Serial>> nodes;
+    for(int i = 0; i < nodeCount; i++)
+        nodes.emplace_back(new Serial(bus.connect(), pinScl, pinSda, opts));
+    
+    std::vector<int> written(nodeCount, 0);
+    std::vector<std::set<std::pair<int, int>>> received(nodeCount);
+    int duplicates = 0;
+    std::size_t bytes = 0;
+    
+    // Reads everything received by the nodes, counting the packets received before:
+    auto readAll = [&] () {
+        for(int i = 0; i < nodeCount; i++)
+        {
+            for(Serial::packet_view p = nodes[i]->peek_view(); !p.empty(); p = nodes[i]->peek_view())
+            {
+                if(received[i].insert(std::make_pair((int) p[0], (int) p[1])).second)
+                    bytes += p.size();
+                else
+                    duplicates++;
+                nodes[i]->release();
+            }
+        }
+    };
+    
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::chrono::steady_clock::time_point end = start + std::chrono::seconds(15);
+    bool sending = true;
+    while(sending && std::chrono::steady_clock::now() < end)
+    {
+        // Keep a couple of packets waiting on each node, each carrying its sender and number:
+        sending = false;
+        for(int i = 0; i < nodeCount; i++)
+        {
+            while(written[i] < packetsPerNode && nodes[i]->remaining() < 2)
+            {
+                Serial::packet p(packetSize, 0x55);
+                p[0] = i;
+                p[1] = written[i]++;
+                nodes[i]->write(p);
+            }
+            sending = sending || nodes[i]->remaining() > 0;
+        }
+        
+        readAll();
+        usleep(1000);
+    }
+    
+    // Give the last packets time to arrive:
+    usleep(200000);
+    readAll();
+    
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    int delivered = 0;
+    for(const std::set<std::pair<int, int>> &packets : received)
+        delivered += packets.size();
+    int expected = nodeCount * (nodeCount - 1) * packetsPerNode;
+    
+    uint64_t retransmissions = 0;
+    for(const std::unique_ptr<Serial> &node : nodes)
+        retransmissions += node->retransmitted();
+    
+    qInfo("Bit error rate %g: goodput %.0f bytes/s, %d of %d packets delivered, %llu retransmissions",
+          bitErrorRate, bytes / seconds, delivered, expected, (unsigned long long) retransmissions);
+    
+    QCOMPARE(duplicates, 0);
+    if(bitErrorRate == 0)
+        QCOMPARE(delivered, expected);
+}
+
+// A packet written with a key can be replaced for as long as it's waiting for the bus, and no longer.
+// The bytes saved by replacing and cancelling packets include their framing.
+void BusTest::replacesOnlyWaitingPackets()
+{
+    Serial::options opts;
+    opts.bitrate = 8000;
+    opts.edge_events = true;
+    opts.crc = true;
+    const std::size_t framing = 1 + 5; // length byte and CRC trailer
+    
+    // The bus is declared first, so that it outlives the nodes. Another node starts a frame and holds the clock low
+    // until the packets have been written, so nothing can be sent until it stops the frame:
+    SimulatedBus bus;
+    std::unique_ptr<SimulatedBus::Node> staller(bus.connect());
+    auto stall = [&] () {
+        staller->set_level(pinSda, false);
+        staller->set_level(pinScl, false);
+    };
+    auto release = [&] () {
+        staller->set_level(pinScl, true);
+        staller->set_level(pinSda, true);
+    };
+    stall();
+    Serial sender(bus.connect(), pinScl, pinSda, opts);
+    Serial receiver(bus.connect(), pinScl, pinSda, opts);
+    
+    Serial::packet first(20, 1), merged(30, 2);
+    QVERIFY(sender.write_prioritized(first, Serial::priority_interactive, 7));
+    QVERIFY(sender.replace(merged, 7, Serial::priority_interactive));
+    QVERIFY(!sender.replace(Serial::packet(10, 3), 8));
+    QCOMPARE(sender.remaining(), std::size_t(1));
+    QCOMPARE(sender.saved_bytes(), uint64_t(first.size() + framing));
+    
+    // Only the replacement is sent, after which it can't be replaced any more:
+    release();
+    QCOMPARE(receiver.wait_available(2000000), std::size_t(1));
+    QVERIFY(receiver.read() == merged);
+    QVERIFY(!sender.replace(Serial::packet(40, 4), 7));
+    usleep(100000);
+    QCOMPARE(receiver.available(), std::size_t(0));
+    
+    stall();
+    Serial::packet cancelled(50, 5);
+    QVERIFY(sender.write(cancelled));
+    QCOMPARE(sender.cancel_pending(), std::size_t(1));
+    QCOMPARE(sender.saved_bytes(), uint64_t(first.size() + cancelled.size() + 2 * framing));
+    release();
+}
+
+// A node only waits as long as the first packet it will actually send, not a cancelled one in front of it.
+void BusTest::skipsCancelledPriorities()
+{
+    Serial::options opts;
+    opts.bitrate = 8000;
+    opts.edge_events = true;
+    opts.priorities = true;
+    
+    // Both senders write while another node holds the bus, so they start waiting for it at the same time:
+    SimulatedBus bus;
+    std::unique_ptr<SimulatedBus::Node> staller(bus.connect());
+    staller->set_level(pinSda, false);
+    staller->set_level(pinScl, false);
+    Serial urgent(bus.connect(), pinScl, pinSda, opts);
+    Serial normal(bus.connect(), pinScl, pinSda, opts);
+    Serial receiver(bus.connect(), pinScl, pinSda, opts);
+    
+    QVERIFY(urgent.write_prioritized(Serial::packet(20, 1), Serial::priority_bulk));
+    QCOMPARE(urgent.cancel_pending(), std::size_t(1));
+    QVERIFY(urgent.write_prioritized(Serial::packet(20, 2), Serial::priority_interactive));
+    QVERIFY(normal.write_prioritized(Serial::packet(20, 3), Serial::priority_normal));
+    
+    staller->set_level(pinScl, true);
+    staller->set_level(pinSda, true);
+    QCOMPARE(receiver.wait_available(2000000), std::size_t(1));
+    QVERIFY(receiver.read() == Serial::packet(20, 2));
+    QCOMPARE(receiver.wait_available(2000000), std::size_t(1));
+    QVERIFY(receiver.read() == Serial::packet(20, 3));
+}
+
+// Only 0, 1, 3 or 7 extra data lines divide a byte evenly, and all the lines must be different. An instance
+// given anything else is left stopped, without pulling any line low.
+void BusTest::rejectsInvalidDataLines()
+{
+    const bool divides[] = { true, true, false, true, false, false, false, true };
+    
+    SimulatedBus bus;
+    for(int extra = 0; extra < 8; extra++)
+    {
+        Serial::options opts;
+        for(int i = 0; i < extra; i++)
+            opts.extra_data_pins.push_back(2 + i);
+        
+        Serial serial(bus.connect(), pinScl, pinSda, opts);
+        QCOMPARE(serial.valid(), divides[extra]);
+        QCOMPARE(serial.stopped(), !divides[extra]);
+    }
+    
+    Serial::options repeated;
+    repeated.extra_data_pins = { 2, pinScl, 3 };
+    Serial serial(bus.connect(), pinScl, pinSda, repeated);
+    QVERIFY(!serial.valid());
+    QVERIFY(bus.get_level(pinScl) && bus.get_level(pinSda));
+}
+
+QTEST_GUILESS_MAIN(BusTest)
+
+#include "tst_bus.moc"
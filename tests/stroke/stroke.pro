@@ -0,0 +1,14 @@
+# Tests of how pen strokes are simplified and streamed as they're sent.
+TARGET = tst_stroke
+CONFIG += console testcase
+CONFIG -= app_bundle
+
+DESTDIR = build
+OBJECTS_DIR = build/.obj
+MOC_DIR = build/.moc
+
+include(../../canvas.pri)
+
+SOURCES += tst_stroke.cpp
+
+QT += testlib
@@ -0,0 +1,219 @@
+#include "canvas.h"
+#include "simulated_bus.hpp"
+
+#include <QtTest>
+#include <QApplication>
+
+#include <random>
+#include <cmath>
+#include <memory>
+
+// Checks how much the simplification of pen strokes shrinks them, how far it moves them, and how they're streamed.
+class StrokeTest : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void reducesDenseStrokes();
+    void boundsDeviation_data();
+    void boundsDeviation();
+    void boundsDeviationAtEnd();
+    void mergesWaitingChunks();
+    void releaseWithoutStroke();
+
+private:
+    static QVector<QVector<QPoint>> slowStrokes(int count);                                 // strokes drawn slowly by hand
+    static double deviation(const QVector<QPoint> &stroke, const QVector<QPoint> &simplified); // furthest point from the simplified stroke
+};
+
+// Random strokes of 2000 pointer movements, each under a pixel and turning a little, as reported by a pointer
+// moving slowly (with repeated positions left out, as the input stage does).
+QVector<QVector<QPoint>> StrokeTest::slowStrokes(int count)
+{
+    std::mt19937 random(1);
+    std::uniform_real_distribution<double> turn(-1, 1);
+    
+    QVector<QVector<QPoint>> strokes;
+    for(int s = 0; s < count; s++)
+    {
+        QVector<QPoint> stroke;
+        double x = 400;
+        double y = 300;
+        double angle = turn(random) * 3;
+        for(int i = 0; i < 2000; i++)
+        {
+            angle += turn(random) * 0.1;
+            x += std::cos(angle) * 0.7;
+            y += std::sin(angle) * 0.7;
+            
+            QPoint point(qRound(x), qRound(y));
+            if(stroke.isEmpty() || stroke.last() != point)
+                stroke.append(point);
+        }
+        strokes.append(stroke);
+    }
+    return strokes;
+}
+
+// Distance from each point of a stroke to the nearest segment of its simplification, taking the largest.
+double StrokeTest::deviation(const QVector<QPoint> &stroke, const QVector<QPoint> &simplified)
+{
+    double furthest = 0;
+    for(const QPoint &p : stroke)
+    {
+        double nearest = std::hypot(p.x() - simplified.first().x(), p.y() - simplified.first().y());
+        for(int i = 1; i < simplified.size(); i++)
+        {
+            QPointF a = simplified[i - 1];
+            QPointF b = simplified[i];
+            QPointF d = b - a;
+            double lengthSquared = QPointF::dotProduct(d, d);
+            double t = lengthSquared > 0 ? qBound(0.0, QPointF::dotProduct(p - a, d) / lengthSquared, 1.0) : 0;
+            QPointF offset = p - (a + t * d);
+            nearest = qMin(nearest, std::hypot(offset.x(), offset.y()));
+        }
+        furthest = qMax(furthest, nearest);
+    }
+    return furthest;
+}
+
+void StrokeTest::reducesDenseStrokes()
+{
+    canvas c;
+    c.setSimplification(1.0, 2);
+    
+    int points = 0;
+    int kept = 0;
+    double smallestRatio = INFINITY;
+    for(const QVector<QPoint> &stroke : slowStrokes(100))
+    {
+        QVector<QPoint> simplified = c.simplifyStroke(stroke);
+        QCOMPARE(simplified.first(), stroke.first());
+        QCOMPARE(simplified.last(), stroke.last());
+        
+        points += stroke.size();
+        kept += simplified.size();
+        smallestRatio = qMin(smallestRatio, (double) stroke.size() / simplified.size());
+    }
+    
+    qInfo("Reduction ratio %.1f overall, %.1f at the least", (double) points / kept, smallestRatio);
+    QVERIFY(smallestRatio >= 10);
+}
+
+void StrokeTest::boundsDeviation_data()
+{
+    QTest::addColumn<int>("minDistance");
+    QTest::addColumn<double>("tolerance");
+    
+    QTest::newRow("defaults") << 2 << 1.0;
+    QTest::newRow("distance only") << 4 << 0.0;
+    QTest::newRow("tolerance only") << 0 << 2.0;
+    QTest::newRow("coarse") << 4 << 2.0;
+}
+
+void StrokeTest::boundsDeviation()
+{
+    QFETCH(int, minDistance);
+    QFETCH(double, tolerance);
+    
+    canvas c;
+    c.setSimplification(tolerance, minDistance);
+    
+    double furthest = 0;
+    for(const QVector<QPoint> &stroke : slowStrokes(100))
+        furthest = qMax(furthest, deviation(stroke, c.simplifyStroke(stroke)));
+    
+    qInfo("Maximum deviation %.2f px", furthest);
+    if(minDistance > 0)
+        QVERIFY(furthest < minDistance + tolerance);
+    else
+        QVERIFY(furthest <= tolerance);
+}
+
+// A stroke ending just after a point that's kept, doubling back past it.
+void StrokeTest::boundsDeviationAtEnd()
+{
+    canvas c;
+    c.setSimplification(0, 2);
+    
+    QVector<QPoint> stroke = { QPoint(0, 0), QPoint(0, 10), QPoint(1, 11), QPoint(-1, 9) };
+    QVERIFY(deviation(stroke, c.simplifyStroke(stroke)) < 2);
+}
+
+// Chunks of a stroke streamed while the bus is busy are merged into the chunk still waiting to be sent,
+// while a chunk following one that's already been sent is sent on its own.
+void StrokeTest::mergesWaitingChunks()
+{
+    Serial::options opts;
+    opts.bitrate = 8000;
+    opts.edge_events = true;
+    
+    // The bus is declared first, so that it outlives the nodes. Another node starts a frame and holds the clock low,
+    // so nothing can be sent until it stops the frame:
+    SimulatedBus bus;
+    std::unique_ptr<SimulatedBus::Node> staller(bus.connect());
+    staller->set_level(1, false);
+    staller->set_level(0, false);
+    Serial sender(bus.connect(), 0, 1, opts);
+    Serial receiver(bus.connect(), 0, 1, opts);
+    
+    canvas c;
+    c.setSimplification(0, 0);
+    c.setSerial(&sender);
+    connect(&c, &canvas::sendPacket, &sender, &Serial::write_prioritized);
+    
+    QVector<QPoint> stroke;
+    for(int i = 0; i < 30; i++)
+        stroke.append(QPoint(10 + 3 * i, 20 + i % 4));
+    
+    c.currentLines.points = stroke.mid(0, 10);
+    c.flushStroke(false);
+    c.currentLines.points = stroke.mid(0, 20);
+    c.flushStroke(false);
+    QCOMPARE(sender.remaining(), std::size_t(1));
+    QVERIFY(sender.saved_bytes() > 0);
+    
+    staller->set_level(0, true);
+    staller->set_level(1, true);
+    QCOMPARE(receiver.wait_available(2000000), std::size_t(1));
+    canvas::DecodedPacket merged;
+    QVERIFY(canvas::decode(receiver.peek_view(), merged));
+    QCOMPARE(merged.group.points, stroke.mid(0, 20));
+    receiver.release();
+    
+    c.currentLines.points = stroke;
+    c.flushStroke(true);
+    QCOMPARE(receiver.wait_available(2000000), std::size_t(1));
+    canvas::DecodedPacket next;
+    QVERIFY(canvas::decode(receiver.peek_view(), next));
+    QCOMPARE(next.group.points, stroke.mid(19));
+    QVERIFY(next.last);
+    receiver.release();
+}
+
+// Clicking without moving the pen leaves no group behind, whether strokes are streamed or not.
+void StrokeTest::releaseWithoutStroke()
+{
+    canvas c;
+    c.toolType = "pen";
+    QMouseEvent release(QEvent::MouseButtonRelease, QPointF(5, 5), Qt::LeftButton, Qt::LeftButton, Qt::NoModifier);
+    
+    c.setStreaming(100);
+    c.mouseReleaseEvent(&release);
+    c.setStreaming(0);
+    c.mouseReleaseEvent(&release);
+    QCOMPARE(c.lines.size(), 0);
+}
+
+// The canvas needs a QApplication, which is run without a display unless a Qt platform's been asked for.
+int main(int argc, char *argv[])
+{
+    if(qEnvironmentVariableIsEmpty("QT_QPA_PLATFORM"))
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+    QApplication app(argc, argv);
+    
+    StrokeTest test;
+    return QTest::qExec(&test, argc, argv);
+}
+
+#include "tst_stroke.moc"
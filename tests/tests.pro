@@ -0,0 +1,3 @@
+# Tests, which run without a Raspberry Pi or a display. Run them all with 'make check'.
+TEMPLATE = subdirs
+SUBDIRS = stroke bus